@@ -0,0 +1,43 @@
+//
+/// a MLCB implementation for the host build, with no CAN controller
+/// frames are exchanged in-process: received frames are injected into a queue,
+/// and sent frames are delivered to an optional peer node, simulating a two node bus
+//
+
+#pragma once
+
+#include <MLCB.h>
+
+#define LOOPBACK_QUEUE_LEN 1024U                  // receive queue capacity, in frames
+
+class MLCBLoopback : public MLCBbase {
+
+public:
+  MLCBLoopback(MLCBConfig *the_config);
+
+  // implementations of the MLCBbase pure virtual methods
+  bool begin(bool poll = false, SPIClass spi = SPI);
+  bool available(void);
+  CANFrame getNextMessage(void);
+  bool sendMessage(CANFrame *msg, bool rtr = false, bool ext = false, byte priority = DEFAULT_PRIORITY);
+  void reset(void);
+  unsigned int rxBacklog(void);
+
+  // zero-copy access to the receive queue
+  CANFrame *peekFrame(void);
+  void consumeFrame(void);
+
+  // simulation support
+  void setPeer(MLCBLoopback *peer);
+  bool injectFrame(const CANFrame *frame);
+  unsigned int rxQueueDepth(void);
+
+  CANFrame last_sent;
+  unsigned long tx_credit;                        // frames the simulated controller will accept before refusing to send
+  unsigned long num_sent, num_tx_refused, num_received, num_rx_overflows;
+
+private:
+  CANFrame _rxq[LOOPBACK_QUEUE_LEN];
+  unsigned int _rxhead = 0, _rxtail = 0;
+  MLCBLoopback *_peer = NULL;
+};
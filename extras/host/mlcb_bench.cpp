@@ -0,0 +1,1030 @@
+//
+/// host benchmarks for the MLCB library
+/// exercises the frame dispatch loop, event lookup, event learning and the multipart message engine
+/// against the loopback bus and the EEPROM shims
+///
+/// usage: mlcb_bench [--external] [--index] [--evcache] [--shadow] [--nvlog] [--short-index]
+///   --external   store events in the simulated I2C EEPROM rather than the on-chip EEPROM shim
+///   --index      look up events using the full-key RAM index rather than the hash table
+///   --evcache    keep all event EVs in RAM
+///   --shadow     cache the EEPROM in the write-back RAM shadow
+///   --nvlog      keep the node identity and NVs in the wear-levelled append-only log
+///   --short-index  look up short events using the direct-mapped device number index
+//
+
+#include <atomic>
+#include <limits.h>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#include <EEPROM.h>
+#include <Wire.h>
+
+#include <MLCB.h>
+#include <MLCBParams.h>
+
+#include "MLCBLoopback.h"
+
+static const unsigned int NODE_NN = 1000;
+static const unsigned int PRODUCER_NN = 300;
+static const byte NUM_LEARNED = 200;
+static const unsigned int NUM_DISPATCH_FRAMES = 200000;
+static const unsigned int NUM_LOOKUPS = 200000;
+static const unsigned int NUM_MULTIPART_MESSAGES = 200;
+static const unsigned int NUM_CONTEXT_ALLOCATIONS = 100000;
+static const unsigned int PACED_MESSAGE_LEN = 200;
+static const byte NUM_PACED_MESSAGES = 3;
+static const byte NUM_DEMUX_SENDERS = 32;
+static const unsigned int NUM_DEMUX_ROUNDS = 2000;
+static const unsigned int BACKGROUND_FRAME_INTERVAL = 1000;     // microseconds between frames from other nodes on a busy bus
+static const unsigned int NUM_RING_FRAMES = 60000;
+static const byte TX_QUEUE_DEPTH = 16;
+static const unsigned int NUM_TX_FRAMES = 100000;
+static const unsigned int NUM_NV_WRITES = 20000;
+static const unsigned int NVLOG_START = 2560;
+static const unsigned int NVLOG_LENGTH = 1024;
+static const byte NUM_SHORT_EVENTS = 32;
+static const byte SHORT_INDEX_SIZE = 64;
+static const unsigned int CRC_BUFFER_LEN = 1024;
+static const unsigned int NUM_CRC_PASSES = 2000;
+
+static bool use_external = false;
+static bool use_index = false;
+static bool use_evcache = false;
+static bool use_shadow = false;
+static bool use_nvlog = false;
+static bool use_short_index = false;
+
+static unsigned long events_matched = 0, frames_seen = 0, messages_received = 0, message_errors = 0;
+static unsigned long ring_frames = 0, ring_sequence_errors = 0;
+static unsigned int ring_next_en = 0;
+static unsigned int check_failures = 0;
+
+//
+/// timing helpers
+//
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ns(bench_clock::time_point start) {
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+}
+
+static void report(const char *name, unsigned long ops, double ns) {
+  printf("%-36s %10lu ops %12.1f ns/op %12.0f ops/s\n", name, ops, ns / ops, ops / (ns / 1e9));
+}
+
+//
+/// correctness checks -- a failure is reported, and makes the benchmark exit with a non-zero status
+//
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    printf("%-36s ERROR: %s\n", "", what);
+    ++check_failures;
+  }
+}
+
+//
+/// user handlers
+//
+
+static void eventhandler(byte index, CANFrame *msg, bool ison, byte evval) {
+  (void)index;
+  (void)msg;
+  (void)ison;
+  (void)evval;
+  ++events_matched;
+}
+
+// reads every EV of the matched event, one at a time, as handlers had to before the EV vector handler
+
+static MLCBConfig *ev_config = NULL;
+static unsigned long ev_sum = 0;
+
+static void eventhandler_ev_reads(byte index, CANFrame *msg, bool ison, byte evval) {
+  (void)msg;
+  (void)ison;
+  ev_sum += evval;
+
+  for (byte i = 2; i <= ev_config->EE_NUM_EVS; i++) {
+    ev_sum += ev_config->getEventEVval(index, i);
+  }
+
+  ++events_matched;
+}
+
+static void eventhandler_evs(byte index, CANFrame *msg, bool ison, const byte *evs, byte num_evs) {
+  (void)index;
+  (void)msg;
+  (void)ison;
+
+  for (byte i = 0; i < num_evs; i++) {
+    ev_sum += evs[i];
+  }
+
+  ++events_matched;
+}
+
+static void framehandler(CANFrame *msg) {
+  (void)msg;
+  ++frames_seen;
+}
+
+// frames may be dropped when the receive ring overflows, but must never be reordered or repeated
+
+static void ringframehandler(CANFrame *msg) {
+  unsigned int en = (msg->data[3] << 8) + msg->data[4];
+
+  if (en < ring_next_en) {
+    ++ring_sequence_errors;
+  }
+
+  ring_next_en = en + 1;
+  ++ring_frames;
+}
+
+// a binary multipart payload, with embedded zero bytes
+static byte mp_payload[55];
+static unsigned long messages_sent = 0;
+
+static void messagehandler(void *msg, unsigned int msg_len, byte stream_id, byte status) {
+  (void)stream_id;
+
+  if (status == MLCB_MULTIPART_MESSAGE_COMPLETE && msg_len == sizeof(mp_payload) && memcmp(msg, mp_payload, msg_len) == 0) {
+    ++messages_received;
+  } else {
+    ++message_errors;
+  }
+}
+
+//
+/// build an event or node frame
+//
+
+static CANFrame make_frame(byte canid, byte opc, unsigned int nn, unsigned int en, byte len = 5, byte d5 = 0, byte d6 = 0) {
+  CANFrame frame;
+
+  frame.id = (DEFAULT_PRIORITY << 7) + canid;
+  frame.ext = false;
+  frame.rtr = false;
+  frame.len = len;
+  frame.data[0] = opc;
+  frame.data[1] = highByte(nn);
+  frame.data[2] = lowByte(nn);
+  frame.data[3] = highByte(en);
+  frame.data[4] = lowByte(en);
+  frame.data[5] = d5;
+  frame.data[6] = d6;
+  return frame;
+}
+
+static void drain(MLCBLoopback &node) {
+  while (node.available()) {
+    node.process(255);
+  }
+}
+
+static void setup_layout(MLCBConfig &config) {
+  config.EE_NVS_START = 10;
+  config.EE_NUM_NVS = 20;
+  config.EE_EVENTS_START = 50;
+  config.EE_MAX_EVENTS = 255;
+  config.EE_NUM_EVS = 4;
+
+  if (use_external) {
+    config.setExtEEPROMAddress(EEPROM_I2C_ADDR);
+    config.setEEPROMtype(EEPROM_EXTERNAL);
+  }
+
+  config.setEventIndex(use_index);
+  config.setEVCache(use_evcache ? config.EE_NUM_EVS : 0);
+  config.setShadow(use_shadow);
+
+  if (use_nvlog) {
+    config.setNVLog(NVLOG_START, NVLOG_LENGTH);
+  }
+
+  if (use_short_index) {
+    config.setShortEventIndex(SHORT_INDEX_SIZE);
+  }
+}
+
+static void setup_config(MLCBConfig &config, byte canid) {
+  setup_layout(config);
+  config.begin();
+  config.setNodeNum(NODE_NN);
+  config.setFLiM(true);
+  config.setCANID(canid);
+}
+
+//
+/// learn events using EVLRN frames, as a configuration tool would
+//
+
+static void bench_learn(MLCBLoopback &node, MLCBConfig &config) {
+  CANFrame frame;
+
+  frame = make_frame(1, OPC_NNLRN, NODE_NN, 0, 3);
+  node.injectFrame(&frame);
+  drain(node);
+
+  EEPROM.resetCounters();
+  Wire.resetCounters();
+  config.ee_bytes_requested = config.ee_bytes_written = config.ee_device_writes = 0;
+  bench_clock::time_point start = bench_clock::now();
+
+  for (unsigned int i = 0; i < NUM_LEARNED; i++) {
+    frame = make_frame(1, OPC_EVLRN, PRODUCER_NN, i * 2, 7, 1, i & 0xff);
+    node.injectFrame(&frame);
+    drain(node);
+  }
+
+  report("learn (EVLRN)", NUM_LEARNED, elapsed_ns(start));
+  printf("%-36s eeprom reads = %lu, writes = %lu, commits = %lu, i2c transactions = %lu\n", "", EEPROM.num_reads, EEPROM.num_writes,
+         EEPROM.num_commits, Wire.num_transactions);
+
+  start = bench_clock::now();
+  config.flush();
+  printf("%-36s %10.1f ms\n", "flush", elapsed_ns(start) / 1e6);
+  printf("%-36s bytes requested = %lu, bytes written = %lu, device writes = %lu\n", "", config.ee_bytes_requested,
+         config.ee_bytes_written, config.ee_device_writes);
+
+  frame = make_frame(1, OPC_NNULN, NODE_NN, 0, 3);
+  node.injectFrame(&frame);
+  drain(node);
+}
+
+//
+/// reload the learned event table, as at power on
+//
+
+static void bench_boot(void) {
+  static MLCBConfig boot_config;
+
+  delay(5);                     // let any write cycle started by the learn benchmark complete
+  setup_layout(boot_config);
+  EEPROM.resetCounters();
+  Wire.resetCounters();
+  boot_config.begin();
+
+  printf("%-36s %10lu us, event table %lu us\n", "begin (boot)", boot_config.boot_micros, boot_config.evtable_load_micros);
+  printf("%-36s events = %u, eeprom reads = %lu, i2c transactions = %lu\n", "", (unsigned int)boot_config.numEvents(),
+         EEPROM.num_reads, Wire.num_transactions);
+}
+
+//
+/// rewrite a few NVs and the CANID many times, as a sketch or configuration tool might
+//
+
+static void bench_nv_writes(MLCBConfig &config) {
+
+  EEPROM.resetCounters();
+  config.ee_device_writes = 0;
+  bench_clock::time_point start = bench_clock::now();
+
+  for (unsigned int i = 0; i < NUM_NV_WRITES; i++) {
+    if (i % 4 == 3) {
+      config.setCANID((i & 0x3f) + 1);
+    } else {
+      config.writeNV((i % 4) + 1, i & 0xff);
+    }
+  }
+
+  config.flush();
+  report("writeNV/setCANID", NUM_NV_WRITES, elapsed_ns(start));
+  printf("%-36s device writes = %lu, most writes to one cell = %lu, log appends = %lu, compactions = %lu\n", "",
+         config.ee_device_writes, EEPROM.maxCellWrites(), config.nvlog_appends, config.nvlog_compactions);
+
+  check(config.readNV(1) == ((NUM_NV_WRITES - 4) & 0xff) && config.CANID == (((NUM_NV_WRITES - 1) & 0x3f) + 1), "values not retained");
+
+  config.loadNVs();
+
+  check(config.readNV(1) == ((NUM_NV_WRITES - 4) & 0xff) && config.CANID == (((NUM_NV_WRITES - 1) & 0x3f) + 1), "values not recovered");
+}
+
+//
+/// feed a stream of ACON/ACOF frames through process(), half of which match learned events
+//
+
+static void bench_dispatch(MLCBLoopback &node) {
+  CANFrame frame;
+  unsigned int sent = 0;
+
+  events_matched = 0;
+  EEPROM.resetCounters();
+  Wire.resetCounters();
+  bench_clock::time_point start = bench_clock::now();
+
+  while (sent < NUM_DISPATCH_FRAMES) {
+    while (sent < NUM_DISPATCH_FRAMES && node.rxQueueDepth() < LOOPBACK_QUEUE_LEN - 1) {
+      frame = make_frame(1, (sent & 1) ? OPC_ACOF : OPC_ACON, PRODUCER_NN, (sent % (NUM_LEARNED * 2)));
+      node.injectFrame(&frame);
+      ++sent;
+    }
+
+    drain(node);
+  }
+
+  report("dispatch (ACON/ACOF)", sent, elapsed_ns(start));
+  printf("%-36s matched = %lu, eeprom reads = %lu, i2c transactions = %lu\n", "", events_matched, EEPROM.num_reads, Wire.num_transactions);
+}
+
+//
+/// learn a set of short events, feed ASON/ASOF frames through process(), half of which match, then unlearn them
+//
+
+static void bench_short_events(MLCBLoopback &node) {
+  CANFrame frame;
+  unsigned int sent = 0;
+
+  frame = make_frame(1, OPC_NNLRN, NODE_NN, 0, 3);
+  node.injectFrame(&frame);
+  drain(node);
+
+  for (unsigned int i = 0; i < NUM_SHORT_EVENTS; i++) {
+    frame = make_frame(1, OPC_EVLRN, 0, 100 + i * 2, 7, 1, i);
+    node.injectFrame(&frame);
+    drain(node);
+  }
+
+  events_matched = 0;
+  EEPROM.resetCounters();
+  Wire.resetCounters();
+  bench_clock::time_point start = bench_clock::now();
+
+  while (sent < NUM_DISPATCH_FRAMES) {
+    while (sent < NUM_DISPATCH_FRAMES && node.rxQueueDepth() < LOOPBACK_QUEUE_LEN - 1) {
+      frame = make_frame(1, (sent & 1) ? OPC_ASOF : OPC_ASON, NODE_NN, 100 + (sent % (NUM_SHORT_EVENTS * 2)));
+      node.injectFrame(&frame);
+      ++sent;
+    }
+
+    drain(node);
+  }
+
+  report("dispatch (ASON/ASOF)", sent, elapsed_ns(start));
+  printf("%-36s matched = %lu, eeprom reads = %lu, i2c transactions = %lu\n", "", events_matched, EEPROM.num_reads, Wire.num_transactions);
+
+  for (unsigned int i = 0; i < NUM_SHORT_EVENTS; i++) {
+    frame = make_frame(1, OPC_EVULN, 0, 100 + i * 2);
+    node.injectFrame(&frame);
+    drain(node);
+  }
+
+  frame = make_frame(1, OPC_NNULN, NODE_NN, 0, 3);
+  node.injectFrame(&frame);
+  drain(node);
+}
+
+//
+/// dispatch to handlers that need every EV of the matched event: per-EV reads against the EV vector handler
+//
+
+static void bench_dispatch_evs(MLCBConfig &config) {
+  static MLCBLoopback evnode_reads(&config), evnode_evs(&config);
+  MLCBLoopback *nodes[2] = { &evnode_reads, &evnode_evs };
+  const char *names[2] = { "dispatch, EVs read one at a time", "dispatch, EV vector handler" };
+  unsigned long sums[2];
+  CANFrame frame;
+
+  ev_config = &config;
+  evnode_reads.setEventHandler(eventhandler_ev_reads);
+  evnode_evs.setEventHandler(eventhandler_evs);
+
+  for (byte n = 0; n < 2; n++) {
+    unsigned int sent = 0;
+
+    events_matched = 0;
+    ev_sum = 0;
+    EEPROM.resetCounters();
+    Wire.resetCounters();
+    bench_clock::time_point start = bench_clock::now();
+
+    while (sent < NUM_DISPATCH_FRAMES) {
+      while (sent < NUM_DISPATCH_FRAMES && nodes[n]->rxQueueDepth() < LOOPBACK_QUEUE_LEN - 1) {
+        frame = make_frame(1, OPC_ACON, PRODUCER_NN, (sent % (NUM_LEARNED * 2)));
+        nodes[n]->injectFrame(&frame);
+        ++sent;
+      }
+
+      drain(*nodes[n]);
+    }
+
+    report(names[n], sent, elapsed_ns(start));
+    printf("%-36s matched = %lu, eeprom reads = %lu, i2c transactions = %lu\n", "", events_matched, EEPROM.num_reads, Wire.num_transactions);
+    sums[n] = ev_sum;
+  }
+
+  check(sums[0] == sums[1], "EV values differ");
+}
+
+//
+/// answer NERD while continuing to consume events, one ACON per process() call
+//
+
+static void bench_nerd(MLCBLoopback &node, MLCBLoopback &peer) {
+  CANFrame frame;
+  unsigned int calls = 0;
+  unsigned long sent_before = node.num_sent;
+
+  events_matched = 0;
+  node.setNERDInterval(1);
+  frame = make_frame(1, OPC_NERD, NODE_NN, 0, 3);
+  node.injectFrame(&frame);
+
+  bench_clock::time_point start = bench_clock::now();
+
+  do {
+    frame = make_frame(1, OPC_ACON, PRODUCER_NN, (calls % (NUM_LEARNED * 2)));
+    node.injectFrame(&frame);
+    node.process(1);
+    ++calls;
+  } while (node.isNERDActive());
+
+  double ns = elapsed_ns(start);
+  printf("%-36s %10lu ENRSP in %.1f ms, %u process() calls, events matched meanwhile = %lu\n", "NERD (1 ms interval)",
+         node.num_sent - sent_before, ns / 1e6, calls, events_matched);
+  check(node.num_sent - sent_before == NUM_LEARNED, "ENRSP missing for some events");
+
+  node.setNERDInterval(NERD_DEFAULT_INTERVAL);
+  drain(node);
+  drain(peer);
+}
+
+//
+/// drain a full receive queue with the time-budgeted processFor()
+//
+
+static void bench_budget(MLCBLoopback &node, unsigned long budget_micros) {
+  CANFrame frame;
+  unsigned int frames = 0, calls = 0, backlog;
+  char name[40];
+
+  while (node.rxQueueDepth() < LOOPBACK_QUEUE_LEN - 1) {
+    frame = make_frame(1, OPC_ACON, PRODUCER_NN, (frames++ % (NUM_LEARNED * 2)));
+    node.injectFrame(&frame);
+  }
+
+  bench_clock::time_point start = bench_clock::now();
+
+  do {
+    backlog = node.processFor(budget_micros);
+    ++calls;
+  } while (backlog > 0);
+
+  snprintf(name, sizeof(name), "processFor(%lu us)", budget_micros);
+  report(name, frames, elapsed_ns(start));
+  printf("%-36s calls = %u, %.1f frames per call\n", "", calls, (double)frames / calls);
+}
+
+//
+/// feed the receive ring from a producer thread, standing in for a CAN controller ISR, while the main thread consumes
+//
+
+static void bench_rxring(MLCBConfig &config) {
+  static MLCBLoopback ringnode(&config);
+  std::atomic<bool> done(false);
+
+  ringnode.setFrameHandler(ringframehandler);
+  ringnode.allocateRxRing(64);
+
+  bench_clock::time_point start = bench_clock::now();
+
+  // frames arrive in bursts of 16, with the producer sleeping between bursts so a single core host can run the consumer
+
+  std::thread producer([&]() {
+    CANFrame frame;
+
+    for (unsigned int i = 0; i < NUM_RING_FRAMES; i++) {
+      frame = make_frame(7, OPC_ACON, PRODUCER_NN, i);
+      ringnode.pushReceivedFrame(&frame);
+
+      if (i % 16 == 15) {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+      }
+    }
+
+    done = true;
+  });
+
+  while (!done || ringnode.rxBacklog() > 0) {
+    ringnode.processFor(1000);
+  }
+
+  producer.join();
+  report("rx ring, producer thread", NUM_RING_FRAMES, elapsed_ns(start));
+  printf("%-36s processed = %lu, overflows = %u, high water = %u, sequence errors = %lu\n", "", ring_frames,
+         (unsigned int)ringnode.rxRingOverflows(), (unsigned int)ringnode.rxRingHighwater(), ring_sequence_errors);
+
+  check(ring_frames + ringnode.rxRingOverflows() == NUM_RING_FRAMES && ring_sequence_errors == 0, "frames lost or reordered");
+}
+
+//
+/// the transmit queue: a stalled controller, send order when it recovers, and queued throughput
+//
+
+static void bench_txqueue(MLCBConfig &config) {
+  static MLCBLoopback txnode(&config);
+  CANFrame frame;
+  unsigned int order_errors = 0;
+  byte last_priority = 0;
+
+  txnode.allocateTxQueue(TX_QUEUE_DEPTH);
+  txnode.tx_credit = 0;
+
+  // queue twice the depth of frames with mixed priorities while the controller refuses to send
+  // the priority is carried in the payload so the send order can be checked
+
+  for (unsigned int i = 0; i < TX_QUEUE_DEPTH * 2U; i++) {
+    byte priority = (i * 7) % 16;
+    frame = make_frame(0, OPC_ACON, NODE_NN, i, 5);
+    frame.data[1] = priority;
+    txnode.queueMessage(&frame, false, false, priority);
+  }
+
+  // release one frame at a time; priorities must never decrease in urgency
+
+  while (txnode.txQueueDepth() > 0) {
+    txnode.tx_credit = 1;
+    txnode.processTxQueue();
+
+    if (txnode.last_sent.data[1] < last_priority) {
+      ++order_errors;
+    }
+
+    last_priority = txnode.last_sent.data[1];
+  }
+
+  printf("%-36s depth = %u, high water = %u, drops = %u, retries = %u, order errors = %u\n", "tx queue, stalled controller",
+         (unsigned int)TX_QUEUE_DEPTH, (unsigned int)txnode.txQueueHighwater(), txnode.txQueueDrops(), txnode.txQueueRetries(), order_errors);
+  check(order_errors == 0, "frames sent out of priority order");
+
+  // throughput with a controller that frees its transmit buffers in pairs, so every other frame waits in the queue
+
+  unsigned int stalled_drops = txnode.txQueueDrops();
+  bench_clock::time_point start = bench_clock::now();
+
+  for (unsigned int i = 0; i < NUM_TX_FRAMES; i++) {
+    frame = make_frame(0, OPC_ACON, NODE_NN, i, 5);
+    txnode.tx_credit = (i & 1) ? 2 : 0;
+    txnode.queueMessage(&frame, false, false, (i % 4) << 2);
+  }
+
+  txnode.tx_credit = ULONG_MAX;
+  txnode.processTxQueue();
+
+  report("queueMessage, bursty controller", NUM_TX_FRAMES, elapsed_ns(start));
+  printf("%-36s drops = %u, max wait = %lu us, average wait = %lu us\n", "", txnode.txQueueDrops() - stalled_drops, txnode.txQueueMaxWait(),
+         txnode.txQueueAverageWait());
+}
+
+//
+/// direct event table lookups, hits and misses
+//
+
+static void bench_lookup(MLCBConfig &config) {
+  unsigned long hits = 0;
+
+  EEPROM.resetCounters();
+  Wire.resetCounters();
+  bench_clock::time_point start = bench_clock::now();
+
+  for (unsigned int i = 0; i < NUM_LOOKUPS; i++) {
+    if (config.findExistingEvent(PRODUCER_NN, i % (NUM_LEARNED * 2)) < config.EE_MAX_EVENTS) {
+      ++hits;
+    }
+  }
+
+  report("findExistingEvent", NUM_LOOKUPS, elapsed_ns(start));
+  printf("%-36s hits = %lu, eeprom reads = %lu, i2c transactions = %lu\n", "", hits, EEPROM.num_reads, Wire.num_transactions);
+  check(hits == NUM_LOOKUPS / 2, "stored events not found");
+}
+
+//
+/// send multipart messages from one node to another
+//
+/// send multipart messages from one node to another, copying them to the heap, copying them to reserved pool slots,
+/// or sending from the caller's buffer
+//
+
+static void sendcompletehandler(const void *msg, unsigned int msg_len, byte stream_id) {
+  (void)msg;
+  (void)msg_len;
+  (void)stream_id;
+  ++messages_sent;
+}
+
+static void bench_multipart(MLCBLoopback &sender, MLCBLoopback &receiver, byte send_mode) {
+  static byte stream_ids[] = { 1, 2, 3, 4 };
+  static const char *mode_names[] = { "multipart message, heap copy", "multipart message, pool slot", "multipart message, no copy" };
+
+  for (unsigned int i = 0; i < sizeof(mp_payload); i++) {
+    mp_payload[i] = (i % 7 == 0) ? 0 : (byte)(i * 13);
+  }
+
+  static byte send_storage[MLCBMultipartMessageEx::contextStorageSize()];
+  MLCBMultipartMessageEx mp_send(&sender), mp_receive(&receiver);
+
+  // the zero-copy sender uses static context storage, so sends no heap at all
+  if (send_mode == MULTIPART_SEND_CALLER) {
+    mp_send.useContextStorage(send_storage, sizeof(send_storage));
+  } else {
+    mp_send.allocateContexts();
+  }
+
+  mp_send.setDelay(0);
+  mp_send.use_crc(true);
+  mp_send.setSendCompleteHandler(sendcompletehandler);
+  mp_receive.allocateContexts();
+  mp_receive.subscribe(stream_ids, sizeof(stream_ids), messagehandler);
+  mp_receive.use_crc(true);
+
+  if (send_mode == MULTIPART_SEND_POOL) {
+    mp_send.reserveSendBuffers(sizeof(mp_payload));
+  }
+
+  messages_received = 0;
+  message_errors = 0;
+  messages_sent = 0;
+  unsigned int queued = 0;
+  unsigned long fragments = sender.num_sent;
+  bench_clock::time_point start = bench_clock::now();
+
+  while (messages_received + message_errors < NUM_MULTIPART_MESSAGES) {
+    if (queued < NUM_MULTIPART_MESSAGES) {
+      byte stream_id = stream_ids[queued % sizeof(stream_ids)];
+
+      if (send_mode == MULTIPART_SEND_CALLER ? mp_send.sendMultipartMessageNoCopy(mp_payload, sizeof(mp_payload), stream_id)
+                                             : mp_send.sendMultipartMessage(mp_payload, sizeof(mp_payload), stream_id)) {
+        ++queued;
+      }
+    }
+
+    mp_send.process();
+    mp_receive.process();
+    sender.process();
+    receiver.process();
+  }
+
+  fragments = sender.num_sent - fragments;
+  double ns = elapsed_ns(start);
+  report(mode_names[send_mode], NUM_MULTIPART_MESSAGES, ns);
+  printf("%-36s fragments = %lu, sent = %lu, errors = %lu, %.0f payload bytes/s\n", "", fragments, messages_sent, message_errors,
+         (NUM_MULTIPART_MESSAGES * sizeof(mp_payload)) / (ns / 1e9));
+  check(message_errors == 0, "multipart messages received in error");
+}
+
+//
+/// send multipart messages with the fixed fragment delay, and with adaptive pacing on a quiet and a busy bus
+//
+
+static void pacedmessagehandler(void *msg, unsigned int msg_len, byte stream_id, byte status) {
+  (void)msg;
+  (void)stream_id;
+
+  if (status == MLCB_MULTIPART_MESSAGE_COMPLETE && msg_len == PACED_MESSAGE_LEN) {
+    ++messages_received;
+  } else {
+    ++message_errors;
+  }
+}
+
+static void bench_pacing(MLCBLoopback &sender, MLCBLoopback &receiver, bool paced, bool busy) {
+  static byte stream_ids[] = { 1 };
+  static byte payload[PACED_MESSAGE_LEN];
+  CANFrame frame;
+  char name[40];
+
+  MLCBMultipartMessageEx mp_send(&sender), mp_receive(&receiver);
+
+  mp_send.allocateContexts(1, 8, 1);
+  mp_receive.allocateContexts(1, PACED_MESSAGE_LEN, 1);
+  drain(receiver);              // discard fragments left over from earlier benchmarks before subscribing
+  mp_receive.subscribe(stream_ids, sizeof(stream_ids), pacedmessagehandler);
+
+  if (paced) {
+    mp_send.setPacing(8, 1000);
+  }
+
+  messages_received = 0;
+  message_errors = 0;
+  unsigned int queued = 0;
+  unsigned long background = 0, fragments = sender.num_sent;
+  unsigned long last_background = micros();
+  bench_clock::time_point start = bench_clock::now();
+
+  while (messages_received + message_errors < NUM_PACED_MESSAGES) {
+    if (queued < NUM_PACED_MESSAGES && !mp_send.is_sending() && mp_send.sendMultipartMessageNoCopy(payload, sizeof(payload), stream_ids[0])) {
+      ++queued;
+    }
+
+    // other nodes' traffic, seen by the sender
+    if (busy && micros() - last_background >= BACKGROUND_FRAME_INTERVAL) {
+      last_background += BACKGROUND_FRAME_INTERVAL;
+      frame = make_frame(9, OPC_ACON, PRODUCER_NN + 1, background & 0xff);
+      sender.injectFrame(&frame);
+      ++background;
+    }
+
+    mp_send.process();
+    sender.process();
+    receiver.process();
+  }
+
+  fragments = sender.num_sent - fragments;
+  double ns = elapsed_ns(start);
+  snprintf(name, sizeof(name), "multipart %s%s", paced ? "paced" : "fixed delay", busy ? ", busy bus" : "");
+  report(name, NUM_PACED_MESSAGES, ns);
+  printf("%-36s fragments = %lu, errors = %lu, %.0f payload bytes/s, rate = %u fragments/s, background frames = %lu\n", "", fragments,
+         message_errors, (NUM_PACED_MESSAGES * PACED_MESSAGE_LEN) / (ns / 1e9), mp_send.pacingRate(), background);
+  check(message_errors == 0, "multipart messages received in error");
+}
+
+//
+/// schedule concurrent send streams: process() calls needed per fragment with a single stream,
+/// and the share of fragments taken by an urgent stream against a normal one
+//
+
+static void bench_scheduler(MLCBLoopback &sender, byte budget) {
+  static byte payload[PACED_MESSAGE_LEN];
+  unsigned long calls = 0, urgent = 0, normal = 0;
+  char name[40];
+
+  MLCBMultipartMessageEx mp_send(&sender);
+
+  mp_send.allocateContexts(1, 8, 4);
+  mp_send.setDelay(0);
+  mp_send.setSendBudget(budget);
+
+  // a single stream
+  unsigned long fragments = sender.num_sent;
+  mp_send.sendMultipartMessageNoCopy(payload, sizeof(payload), 1);
+
+  while (mp_send.is_sending()) {
+    mp_send.process();
+    sender.process();
+    ++calls;
+  }
+
+  fragments = sender.num_sent - fragments;
+  snprintf(name, sizeof(name), "scheduler, budget %u", budget);
+  printf("%-36s single stream: %.2f process() calls per fragment\n", name, (double)calls / fragments);
+
+  // an urgent stream and a normal one, counted until the first completes
+  fragments = sender.num_sent;
+  mp_send.sendMultipartMessageNoCopy(payload, sizeof(payload), 1, 0x0);
+  mp_send.sendMultipartMessageNoCopy(payload, sizeof(payload), 2, DEFAULT_PRIORITY);
+
+  while (mp_send.is_sending() == 2) {
+    mp_send.process();
+    sender.process();
+  }
+
+  // the urgent stream finished first, having sent its header and every data fragment
+  sender.process();
+  urgent = 1 + (PACED_MESSAGE_LEN + 4) / 5;
+  normal = sender.num_sent - fragments - urgent;
+
+  printf("%-36s urgent : normal fragments = %lu : %lu\n", "", urgent, normal);
+
+  while (mp_send.is_sending()) {
+    mp_send.process();
+    sender.process();
+  }
+}
+
+//
+/// reassemble many concurrent streams, each from a different sender, with their fragments interleaved
+//
+
+static void demuxmessagehandler(void *msg, unsigned int msg_len, byte stream_id, byte status) {
+  (void)msg;
+  (void)msg_len;
+  (void)stream_id;
+
+  if (status == MLCB_MULTIPART_MESSAGE_COMPLETE) {
+    ++messages_received;
+  } else {
+    ++message_errors;
+  }
+}
+
+static void bench_demux(MLCBLoopback &receiver) {
+  static byte stream_ids[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  static const byte MESSAGE_LEN = 50;
+  CANFrame frame;
+  unsigned long fragments = 0;
+
+  MLCBMultipartMessageEx mp_receive(&receiver);
+
+  mp_receive.allocateContexts(NUM_DEMUX_SENDERS, MESSAGE_LEN, 1);
+  mp_receive.subscribe(stream_ids, sizeof(stream_ids), demuxmessagehandler);
+
+  messages_received = 0;
+  message_errors = 0;
+  memset(&frame, 0, sizeof(frame));
+  frame.len = 8;
+  frame.data[0] = OPC_DTXC;
+  bench_clock::time_point start = bench_clock::now();
+
+  for (unsigned int r = 0; r < NUM_DEMUX_ROUNDS; r++) {
+    // a header from every sender, then each sender's continuation fragments in turn
+    for (byte seq = 0; seq <= MESSAGE_LEN / 5; seq++) {
+      for (byte s = 0; s < NUM_DEMUX_SENDERS; s++) {
+        frame.id = 10 + s;
+        frame.data[1] = stream_ids[s % sizeof(stream_ids)];
+        frame.data[2] = seq;
+        frame.data[3] = (seq == 0) ? 0 : s;
+        frame.data[4] = (seq == 0) ? MESSAGE_LEN : seq;
+        mp_receive.processReceivedMessageFragment(&frame);
+        ++fragments;
+      }
+    }
+  }
+
+  report("multipart demux (32 streams)", fragments, elapsed_ns(start));
+  printf("%-36s messages = %lu, errors = %lu\n", "", messages_received, message_errors);
+  check(message_errors == 0, "multipart messages received in error");
+}
+
+//
+/// allocate and release the multipart context pool
+//
+
+static void bench_contexts(MLCBLoopback &node) {
+  MLCBMultipartMessageEx mp(&node);
+  unsigned long failures = 0;
+
+  bench_clock::time_point start = bench_clock::now();
+
+  for (unsigned int i = 0; i < NUM_CONTEXT_ALLOCATIONS; i++) {
+    if (!mp.allocateContexts()) {
+      ++failures;
+    }
+
+    mp.releaseContexts();
+  }
+
+  report("allocate/releaseContexts", NUM_CONTEXT_ALLOCATIONS, elapsed_ns(start));
+  printf("%-36s storage = %lu bytes in 1 block, failures = %lu\n", "", (unsigned long)MLCBMultipartMessageEx::contextStorageSize(), failures);
+  check(failures == 0, "context allocation failed");
+}
+
+//
+/// compare the bitwise, nibble table and byte table CRC routines, and feeding a message fragment by fragment
+//
+
+static void bench_crc(void) {
+  static byte buf[CRC_BUFFER_LEN];
+  uint16_t c16[3];
+  uint32_t c32[3];
+  char name[40];
+
+  for (unsigned int i = 0; i < CRC_BUFFER_LEN; i++) {
+    buf[i] = (byte)(i * 31 + 7);
+  }
+
+  uint16_t (*crc16_variants[])(uint16_t, const byte *, unsigned int) = { crc16_update_bitwise, crc16_update_nibble, crc16_update_byte };
+  uint32_t (*crc32_variants[])(uint32_t, const byte *, unsigned int) = { crc32_update_bitwise, crc32_update_nibble, crc32_update_byte };
+  const char *variant_names[] = { "bitwise", "nibble table", "byte table" };
+
+  for (byte v = 0; v < 3; v++) {
+    bench_clock::time_point start = bench_clock::now();
+
+    for (unsigned int n = 0; n < NUM_CRC_PASSES; n++) {
+      c16[v] = crc16_variants[v](0xffff, buf, CRC_BUFFER_LEN);
+    }
+
+    snprintf(name, sizeof(name), "crc16 %s (bytes)", variant_names[v]);
+    report(name, NUM_CRC_PASSES * CRC_BUFFER_LEN, elapsed_ns(start));
+  }
+
+  for (byte v = 0; v < 3; v++) {
+    bench_clock::time_point start = bench_clock::now();
+
+    for (unsigned int n = 0; n < NUM_CRC_PASSES; n++) {
+      c32[v] = crc32_variants[v](0xffffffff, buf, CRC_BUFFER_LEN);
+    }
+
+    snprintf(name, sizeof(name), "crc32 %s (bytes)", variant_names[v]);
+    report(name, NUM_CRC_PASSES * CRC_BUFFER_LEN, elapsed_ns(start));
+  }
+
+  // a message fed five bytes at a time, as the receiver does, must match the one-shot CRC
+  MLCBCRC16 crc;
+
+  for (unsigned int i = 0; i < CRC_BUFFER_LEN; i += 5) {
+    crc.update(&buf[i], (CRC_BUFFER_LEN - i < 5) ? CRC_BUFFER_LEN - i : 5);
+  }
+
+  bool agree = c16[0] == c16[1] && c16[1] == c16[2] && c32[0] == c32[1] && c32[1] == c32[2] && crc.value() == crc16(buf, CRC_BUFFER_LEN);
+  printf("%-36s variants %s\n", "", agree ? "agree" : "DISAGREE");
+  check(agree, "CRC variants disagree");
+}
+
+//
+/// clear the external EEPROM event area, as NNCLR and a module reset do
+//
+
+static void bench_reset_eeprom(MLCBConfig &config) {
+
+  Wire.resetCounters();
+  bench_clock::time_point start = bench_clock::now();
+  config.resetEEPROM();
+  config.waitForExtEEPROM();
+
+  printf("%-36s %10.1f ms\n", "resetEEPROM", elapsed_ns(start) / 1e6);
+  printf("%-36s i2c transactions = %lu, write cycles = %lu, bytes written = %lu\n", "", Wire.num_transactions,
+         Wire.num_write_cycles, Wire.bytes_written);
+}
+
+int main(int argc, char *argv[]) {
+
+  static MLCBConfig config, peer_config;
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  static MLCBLoopback node(&config), peer(&peer_config);
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--external") == 0) {
+      use_external = true;
+    } else if (strcmp(argv[i], "--index") == 0) {
+      use_index = true;
+    } else if (strcmp(argv[i], "--evcache") == 0) {
+      use_evcache = true;
+    } else if (strcmp(argv[i], "--shadow") == 0) {
+      use_shadow = true;
+    } else if (strcmp(argv[i], "--nvlog") == 0) {
+      use_nvlog = true;
+    } else if (strcmp(argv[i], "--short-index") == 0) {
+      use_short_index = true;
+    }
+  }
+
+  printf("MLCB host benchmark, events stored in %s EEPROM%s, lookup by %s\n\n", use_external ? "external I2C" : "on-chip",
+         use_shadow ? " with RAM shadow" : "", use_index ? "full-key index" : "hash table");
+
+  if (use_evcache) {
+    printf("event variables cached in RAM\n\n");
+  }
+
+  if (use_nvlog) {
+    printf("identity and NVs kept in the append-only log\n\n");
+  }
+
+  if (use_short_index) {
+    printf("short events looked up by device number\n\n");
+  }
+
+  setup_config(config, 5);
+  setup_config(peer_config, 6);
+
+  static MLCBParams params(config);
+  static unsigned char mname[7] = { 'B', 'E', 'N', 'C', 'H', ' ', ' ' };
+
+  node.setParams(params.getParams());
+  node.setName(mname);
+  node.setEventHandler(eventhandler);
+  node.setFrameHandler(framehandler);
+  node.begin();
+
+  peer.setParams(params.getParams());
+  peer.setName(mname);
+  peer.begin();
+
+  node.setPeer(&peer);
+  peer.setPeer(&node);
+
+  bench_learn(node, config);
+  bench_boot();
+  bench_nv_writes(peer_config);
+  bench_lookup(config);
+  bench_dispatch(node);
+  bench_short_events(node);
+  bench_dispatch_evs(config);
+  bench_nerd(node, peer);
+  bench_budget(node, 100);
+  bench_budget(node, 1000);
+  bench_rxring(config);
+  bench_txqueue(config);
+  bench_multipart(peer, node, MULTIPART_SEND_HEAP);
+  bench_multipart(peer, node, MULTIPART_SEND_POOL);
+  bench_multipart(peer, node, MULTIPART_SEND_CALLER);
+  bench_contexts(peer);
+  bench_demux(node);
+  bench_scheduler(peer, 1);
+  bench_scheduler(peer, 4);
+  bench_pacing(peer, node, false, false);
+  bench_pacing(peer, node, true, false);
+  bench_pacing(peer, node, true, true);
+  bench_crc();
+
+  if (use_external) {
+    bench_reset_eeprom(config);
+  }
+
+  return (check_failures > 0) ? 1 : 0;
+}
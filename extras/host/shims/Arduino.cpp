@@ -0,0 +1,80 @@
+//
+/// host implementation of the Arduino core shim
+//
+
+#include <Arduino.h>
+
+#include <chrono>
+#include <stdarg.h>
+#include <stdio.h>
+#include <thread>
+
+HardwareSerial Serial;
+
+static const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+unsigned long millis(void) {
+  return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+unsigned long micros(void) {
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  (void)pin;
+  (void)val;
+}
+
+int digitalRead(uint8_t pin) {
+  (void)pin;
+  return HIGH;
+}
+
+size_t Print::write(uint8_t c) {
+  return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+size_t Print::write(const char *str) {
+  size_t n = 0;
+
+  while (*str) {
+    n += write((uint8_t)*str++);
+  }
+
+  return n;
+}
+
+static size_t print_formatted(Print *p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static size_t print_formatted(Print *p, const char *fmt, ...) {
+  char buf[32];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  return p->write(buf);
+}
+
+size_t Print::print(const char *str) { return write(str); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(int n) { return print_formatted(this, "%d", n); }
+size_t Print::print(unsigned int n) { return print_formatted(this, "%u", n); }
+size_t Print::print(long n) { return print_formatted(this, "%ld", n); }
+size_t Print::print(unsigned long n) { return print_formatted(this, "%lu", n); }
+size_t Print::print(double n) { return print_formatted(this, "%.2f", n); }
+size_t Print::println(void) { return write((uint8_t)'\n'); }
@@ -0,0 +1,81 @@
+//
+/// minimal Arduino core shim for building the MLCB library on a Linux host
+/// only the parts of the Arduino API used by this library are provided
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+#define F(string_literal) (string_literal)
+
+// program memory -- there is a single address space on the host
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define memcpy_P memcpy
+
+// time
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// digital I/O -- there is no hardware, so pins read as HIGH and writes are discarded
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+// serial output
+
+class Print {
+
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c);
+  size_t write(const char *str);
+
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(int n);
+  size_t print(unsigned int n);
+  size_t print(long n);
+  size_t print(unsigned long n);
+  size_t print(double n);
+  size_t println(void);
+};
+
+class HardwareSerial : public Print {
+
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  void flush(void) {}
+  operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,60 @@
+//
+/// host implementation of the on-chip EEPROM shim
+//
+
+#include <EEPROM.h>
+#include <SPI.h>
+
+EEPROMClass EEPROM;
+SPIClass SPI;
+
+EEPROMClass::EEPROMClass() {
+  memset(_data, 0xff, sizeof(_data));
+  resetCounters();
+}
+
+void EEPROMClass::begin(size_t size) {
+  (void)size;
+}
+
+uint8_t EEPROMClass::read(int idx) {
+  ++num_reads;
+  return (idx >= 0 && idx < HOST_EEPROM_SIZE) ? _data[idx] : 0xff;
+}
+
+void EEPROMClass::write(int idx, uint8_t val) {
+  ++num_writes;
+
+  if (idx >= 0 && idx < HOST_EEPROM_SIZE) {
+    _data[idx] = val;
+    ++_cell_writes[idx];
+  }
+}
+
+void EEPROMClass::update(int idx, uint8_t val) {
+  if (read(idx) != val) {
+    write(idx, val);
+  }
+}
+
+bool EEPROMClass::commit(void) {
+  ++num_commits;
+  return true;
+}
+
+void EEPROMClass::resetCounters(void) {
+  num_reads = 0;
+  num_writes = 0;
+  num_commits = 0;
+  memset(_cell_writes, 0, sizeof(_cell_writes));
+}
+
+unsigned long EEPROMClass::maxCellWrites(void) {
+  unsigned long max = 0;
+
+  for (unsigned int i = 0; i < HOST_EEPROM_SIZE; i++) {
+    max = (_cell_writes[i] > max) ? _cell_writes[i] : max;
+  }
+
+  return max;
+}
@@ -0,0 +1,34 @@
+//
+/// on-chip EEPROM shim -- a RAM array initialised to the erased state (0xff)
+/// write and commit counters are provided so storage traffic can be measured
+//
+
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef HOST_EEPROM_SIZE
+#define HOST_EEPROM_SIZE 4096
+#endif
+
+class EEPROMClass {
+
+public:
+  EEPROMClass();
+  void begin(size_t size);
+  uint8_t read(int idx);
+  void write(int idx, uint8_t val);
+  void update(int idx, uint8_t val);
+  bool commit(void);
+  uint16_t length(void) { return HOST_EEPROM_SIZE; }
+  void resetCounters(void);
+  unsigned long maxCellWrites(void);
+
+  unsigned long num_reads, num_writes, num_commits;
+
+private:
+  uint8_t _data[HOST_EEPROM_SIZE];
+  unsigned long _cell_writes[HOST_EEPROM_SIZE];     // per-cell write counts, to show wear hot spots
+};
+
+extern EEPROMClass EEPROM;
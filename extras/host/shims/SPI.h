@@ -0,0 +1,16 @@
+//
+/// SPI shim -- the host build has no SPI bus, this only satisfies the MLCBbase::begin() signature
+//
+
+#pragma once
+
+#include <Arduino.h>
+
+class SPIClass {
+
+public:
+  void begin(void) {}
+  void end(void) {}
+};
+
+extern SPIClass SPI;
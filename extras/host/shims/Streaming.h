@@ -0,0 +1,21 @@
+//
+/// minimal shim of the Streaming library -- C++ stream style output to a Print object
+//
+
+#pragma once
+
+#include <Arduino.h>
+
+enum _EndLineCode { endl };
+
+template<class T>
+inline Print &operator <<(Print &obj, T arg) {
+  obj.print(arg);
+  return obj;
+}
+
+inline Print &operator <<(Print &obj, _EndLineCode arg) {
+  (void)arg;
+  obj.println();
+  return obj;
+}
@@ -0,0 +1,127 @@
+//
+/// host implementation of the I2C shim and simulated external EEPROM
+//
+
+#include <Wire.h>
+
+TwoWire Wire;
+
+TwoWire::TwoWire() {
+  device_address = 0x50;
+  page_size = 64;
+  write_cycle_us = 3000;
+  _target = 0;
+  _txlen = 0;
+  _rxlen = 0;
+  _rxidx = 0;
+  _pointer = 0;
+  _busy_since = 0;
+  _busy = false;
+  memset(_mem, 0xff, sizeof(_mem));
+  resetCounters();
+}
+
+void TwoWire::resetCounters(void) {
+  num_transactions = 0;
+  num_nacks = 0;
+  num_write_cycles = 0;
+  bytes_written = 0;
+  bytes_read = 0;
+}
+
+bool TwoWire::deviceBusy(void) {
+  if (_busy && (micros() - _busy_since) >= write_cycle_us) {
+    _busy = false;
+  }
+
+  return _busy;
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+  _target = address;
+  _txlen = 0;
+}
+
+size_t TwoWire::write(uint8_t data) {
+  if (_txlen >= BUFFER_LENGTH) {
+    return 0;
+  }
+
+  _txbuf[_txlen++] = data;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t quantity) {
+  size_t n = 0;
+
+  while (n < quantity && write(data[n])) {
+    ++n;
+  }
+
+  return n;
+}
+
+// returns 0 on success, 2 if the address was NACKed (no device, or device busy in its write cycle)
+
+uint8_t TwoWire::endTransmission(bool sendStop) {
+  (void)sendStop;
+  ++num_transactions;
+
+  if (_target != device_address || deviceBusy()) {
+    ++num_nacks;
+    return 2;
+  }
+
+  if (_txlen >= 2) {
+    _pointer = ((_txbuf[0] << 8) + _txbuf[1]) % sizeof(_mem);
+  }
+
+  if (_txlen > 2) {
+    // data bytes wrap around within the current page, as a real device does
+    uint16_t page_base = _pointer - (_pointer % page_size);
+
+    for (uint8_t i = 2; i < _txlen; i++) {
+      _mem[_pointer] = _txbuf[i];
+      _pointer = page_base + ((_pointer + 1 - page_base) % page_size);
+      ++bytes_written;
+    }
+
+    ++num_write_cycles;
+    _busy = true;
+    _busy_since = micros();
+  }
+
+  _txlen = 0;
+  return 0;
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity) {
+  ++num_transactions;
+  _rxlen = 0;
+  _rxidx = 0;
+
+  if ((uint8_t)address != device_address || deviceBusy()) {
+    ++num_nacks;
+    return 0;
+  }
+
+  if (quantity > BUFFER_LENGTH) {
+    quantity = BUFFER_LENGTH;
+  }
+
+  for (int i = 0; i < quantity; i++) {
+    _rxbuf[_rxlen++] = _mem[_pointer];
+    _pointer = (_pointer + 1) % sizeof(_mem);
+    ++bytes_read;
+  }
+
+  return _rxlen;
+}
+
+int TwoWire::available(void) {
+  return _rxlen - _rxidx;
+}
+
+int TwoWire::read(void) {
+  return (_rxidx < _rxlen) ? _rxbuf[_rxidx++] : -1;
+}
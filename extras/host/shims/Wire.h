@@ -0,0 +1,50 @@
+//
+/// I2C shim -- a TwoWire class with a simulated 24LC256-style EEPROM attached at EEPROM_I2C_ADDR (0x50)
+/// models the 32 byte Wire buffer, page-wrapping writes and the device write cycle, during which it NACKs
+//
+
+#pragma once
+
+#include <Arduino.h>
+
+#define BUFFER_LENGTH 32
+
+class TwoWire {
+
+public:
+  TwoWire();
+  void begin(void) {}
+  void setClock(uint32_t clock) { (void)clock; }
+  void beginTransmission(uint8_t address);
+  void beginTransmission(int address) { beginTransmission((uint8_t)address); }
+  uint8_t endTransmission(bool sendStop = true);
+  size_t write(uint8_t data);
+  size_t write(int data) { return write((uint8_t)data); }
+  size_t write(const uint8_t *data, size_t quantity);
+  uint8_t requestFrom(int address, int quantity);
+  int available(void);
+  int read(void);
+
+  void resetCounters(void);
+
+  // simulated device characteristics
+  uint8_t device_address;
+  unsigned int page_size;
+  unsigned long write_cycle_us;
+
+  // traffic counters
+  unsigned long num_transactions, num_nacks, num_write_cycles, bytes_written, bytes_read;
+
+private:
+  bool deviceBusy(void);
+
+  uint8_t _target;
+  uint8_t _txbuf[BUFFER_LENGTH], _txlen;
+  uint8_t _rxbuf[BUFFER_LENGTH], _rxlen, _rxidx;
+  uint16_t _pointer;
+  unsigned long _busy_since;
+  bool _busy;
+  uint8_t _mem[32768];
+};
+
+extern TwoWire Wire;
@@ -54,27 +54,96 @@ MLCBbase::MLCBbase(MLCBConfig *the_config) {
 
 //
 /// register the user handler for learned events
+/// only one event handler is active: registering any form replaces a handler registered with another form
 //
 
 void MLCBbase::setEventHandler(void (*fptr)(byte index, CANFrame *msg)) {
+  clearEventHandlers();
   eventhandler = fptr;
 }
 
 // overloaded form which receives the opcode on/off state and the first event variable
 
 void MLCBbase::setEventHandler(void (*fptr)(byte index, CANFrame *msg, bool ison, byte evval)) {
+  clearEventHandlers();
   eventhandlerex = fptr;
 }
 
+// overloaded form which receives the opcode on/off state and all the event variables of the matched event
+// the EVs are fetched in one read, or directly from the EV cache, and are valid only for the duration of the call
+// the EV buffer is sized from the config's EE_NUM_EVS, which must be set first; returns false if it cannot be allocated
+
+bool MLCBbase::setEventHandler(void (*fptr)(byte index, CANFrame *msg, bool ison, const byte *evs, byte num_evs)) {
+
+  clearEventHandlers();
+
+  if (fptr != NULL && module_config->EE_NUM_EVS > 0) {
+    if ((_evbuf = (byte *)malloc(module_config->EE_NUM_EVS)) == NULL) {
+      return false;
+    }
+
+    _evbuf_len = module_config->EE_NUM_EVS;
+  }
+
+  eventhandlerevs = fptr;
+  return true;
+}
+
+//
+/// unregister every form of event handler, and free the EV buffer
+//
+
+void MLCBbase::clearEventHandlers(void) {
+
+  eventhandler = NULL;
+  eventhandlerex = NULL;
+  eventhandlerevs = NULL;
+  free(_evbuf);
+  _evbuf = NULL;
+  _evbuf_len = 0;
+}
+
 //
 /// register the user handler for CAN frames
 /// default args in .h declaration for opcodes array (NULL) and size (0)
+/// the opcode list is converted to a 256 bit map, an empty list means all opcodes
 //
 
 void MLCBbase::setFrameHandler(void (*fptr)(CANFrame *msg), byte opcodes[], byte num_opcodes) {
+
   framehandler = fptr;
-  _opcodes = opcodes;
-  _num_opcodes = num_opcodes;
+
+  if (opcodes == NULL || num_opcodes == 0) {
+    memset(_framehandler_opcodes, 0xff, sizeof(_framehandler_opcodes));
+  } else {
+    memset(_framehandler_opcodes, 0, sizeof(_framehandler_opcodes));
+
+    for (byte i = 0; i < num_opcodes; i++) {
+      bitSet(_framehandler_opcodes[opcodes[i] / 8], opcodes[i] % 8);
+    }
+  }
+}
+
+//
+/// register a user handler for an individual opcode
+/// it replaces the library's own handler for that opcode, if there is one; NULL restores the library handler
+/// the handler table is allocated on first use
+//
+
+bool MLCBbase::setOpcodeHandler(byte opcode, void (*fptr)(CANFrame *msg)) {
+
+  if (_opcodehandlers == NULL) {
+    if (fptr == NULL) {
+      return true;
+    }
+
+    if ((_opcodehandlers = (void (**)(CANFrame *))calloc(256, sizeof(*_opcodehandlers))) == NULL) {
+      return false;
+    }
+  }
+
+  _opcodehandlers[opcode] = fptr;
+  return true;
 }
 
 //
@@ -126,7 +195,7 @@ bool MLCBbase::sendWRACK(void) {
   _msg.data[0] = OPC_WRACK;
   _msg.data[1] = highByte(module_config->nodeNum);
   _msg.data[2] = lowByte(module_config->nodeNum);
-  return sendMessage(&_msg);
+  return queueReply(&_msg);
 }
 
 //
@@ -141,7 +210,7 @@ bool MLCBbase::sendCMDERR(byte cerrno) {
   _msg.data[1] = highByte(module_config->nodeNum);
   _msg.data[2] = lowByte(module_config->nodeNum);
   _msg.data[3] = cerrno;
-  return sendMessage(&_msg);
+  return queueReply(&_msg);
 }
 
 //
@@ -158,7 +227,7 @@ bool MLCBbase::sendGRSP(byte cerrno, byte opcode, byte data1, byte data2) {
   _msg.data[4] = opcode;
   _msg.data[5] = data1;
   _msg.data[6] = data2;
-  return sendMessage(&_msg);
+  return queueReply(&_msg);
 }
 
 //
@@ -191,7 +260,7 @@ void MLCBbase::start_enumeration(void) {
   enumeration_start = millis();     // the cycle start time
   memset(enumeration_responses, 0, sizeof(enumeration_responses));
   _msg.len = 0;
-  sendMessage(&_msg, true, false);
+  queueReply(&_msg, true);
 
   return;
 }
@@ -211,7 +280,7 @@ void MLCBbase::initFLiM(void) {
   _msg.data[0] = OPC_RQNN;
   _msg.data[1] = highByte(module_config->nodeNum);
   _msg.data[2] = lowByte(module_config->nodeNum);
-  sendMessage(&_msg);
+  queueReply(&_msg);
 
   return;
 }
@@ -229,7 +298,7 @@ void MLCBbase::revertSLiM(void) {
   _msg.data[0] = OPC_NNREL;
   _msg.data[1] = highByte(module_config->nodeNum);
   _msg.data[2] = lowByte(module_config->nodeNum);
-  sendMessage(&_msg);
+  queueReply(&_msg);
   setSLiM();
 
   return;
@@ -301,8 +370,106 @@ void MLCBbase::indicateMode(byte mode) {
 
 void MLCBbase::process(byte num_messages) {
 
-  byte remoteCANID = 0, nvindex = 0, evindex = 0, evval = 0;
-  unsigned int nn = 0, en = 0, j = 0, opc;
+  processNodeState();
+
+  // get received CAN frames from buffer
+  // process by default 3 messages per run so the user's application code doesn't appear unresponsive under load
+
+  byte mcount = 0;
+
+  while (frameAvailable() && mcount < num_messages) {
+    ++mcount;
+    processFrame();
+  }
+
+  processTimeouts();
+  return;
+}
+
+//
+/// time-budgeted alternative to process()
+/// drains received frames until the reception buffer is empty or the budget in microseconds is spent
+/// at least one frame is processed, if available, and the budget is checked between frames
+/// returns the number of frames still waiting, so the application can adapt -- see rxBacklog() for how exact it is
+//
+
+unsigned int MLCBbase::processFor(unsigned long budget_micros) {
+
+  unsigned long start = micros();
+
+  processNodeState();
+
+  if (frameAvailable()) {
+    do {
+      processFrame();
+    } while (frameAvailable() && (micros() - start) < budget_micros);
+  }
+
+  processTimeouts();
+  return rxBacklog();
+}
+
+//
+/// the number of received frames waiting to be processed
+/// without a receive ring, the base implementation can only tell whether there are any;
+/// derived classes may override this with an exact count
+//
+
+unsigned int MLCBbase::rxBacklog(void) {
+
+  if (_rxring.allocated()) {
+    return _rxring.count();
+  }
+
+  return ((_rxcopy_valid || available()) ? 1 : 0);
+}
+
+//
+/// is there a received frame waiting ?
+/// when a receive ring has been allocated, it is the only source of frames
+//
+
+bool MLCBbase::frameAvailable(void) {
+
+  if (_rxring.allocated()) {
+    return (_rxring.count() > 0);
+  }
+
+  return (_rxcopy_valid || available());
+}
+
+//
+/// allocate the receive ring -- depth must be a power of two, from 2 to 128 frames
+/// once allocated, the derived class (typically its CAN controller interrupt handler) feeds received frames
+/// to pushReceivedFrame() and process() consumes them in place
+//
+
+bool MLCBbase::allocateRxRing(byte depth) {
+
+  return _rxring.allocate(depth);
+}
+
+//
+/// add a received frame to the receive ring -- the producer side, safe to call from an ISR
+/// returns false, and counts an overflow, if the ring is full
+//
+
+bool MLCBbase::pushReceivedFrame(const CANFrame *frame) {
+
+  return _rxring.push(frame);
+}
+
+//
+/// housekeeping before frames are processed -- transmit queue, enumeration, switch and LEDs, heartbeat, storage
+//
+
+void MLCBbase::processNodeState(void) {
+
+  // allow the configuration object to write back any cached storage
+  module_config->process();
+
+  // retry any frames the CAN controller could not accept last time
+  processTxQueue();
 
   // start bus enumeration if required
   if (enumeration_required) {
@@ -356,6 +523,9 @@ void MLCBbase::process(byte num_messages) {
     }
   }
 
+  // send the next response to NERD, if one is in progress
+  processNERD();
+
   // heartbeat
 
   if (isMLCB && hbactive && module_config->FLiM && millis() - hbtimer > HBTIMER_INTERVAL) {
@@ -367,589 +537,787 @@ void MLCBbase::process(byte num_messages) {
     _msg.data[3] = hbcount++;
     _msg.data[4] = 0;
     _msg.data[5] = 0;
-    sendMessage(&_msg);
+    queueReply(&_msg);
   }
+}
 
-  // get received CAN frames from buffer
-  // process by default 3 messages per run so the user's application code doesn't appear unresponsive under load
+//
+/// send the next ENRSP in response to NERD, no more than once per NERD interval
+/// empty event table slots are skipped without waiting
+//
 
-  byte mcount = 0;
+void MLCBbase::processNERD(void) {
 
-  while (available() && mcount < num_messages) {
+  if (!_nerd_active || millis() - _nerd_last < _nerd_interval) {
+    return;
+  }
 
-    ++mcount;
+  while (_nerd_index < module_config->EE_MAX_EVENTS && module_config->getEvTableEntry(_nerd_index) == 0) {
+    ++_nerd_index;
+  }
 
-    // at least one CAN frame is available in the reception buffer
-    // retrieve the next one
+  if (_nerd_index < module_config->EE_MAX_EVENTS) {
+    _msg.len = 8;
+    _msg.data[0] = OPC_ENRSP;                                 // response opcode
+    _msg.data[1] = highByte(module_config->nodeNum);          // my NN hi
+    _msg.data[2] = lowByte(module_config->nodeNum);           // my NN lo
+    module_config->readEvent(_nerd_index, &_msg.data[3]);
+    _msg.data[7] = _nerd_index;                               // event table index
+
+    // a rejected response is retried for the same slot after the next interval
+    if (queueReply(&_msg)) {
+      ++_nerd_index;
+    }
 
-    // memset(&_msg, 0, sizeof(CANFrame));
-    _msg = getNextMessage();
+    _nerd_last = millis();
+  }
 
-    // extract OPC, NN, EN
-    opc = _msg.data[0];
-    nn = (_msg.data[1] << 8) + _msg.data[2];
-    en = (_msg.data[3] << 8) + _msg.data[4];
+  if (_nerd_index >= module_config->EE_MAX_EVENTS) {
+    _nerd_active = false;
+  }
+}
 
-    //
-    /// extract the CANID of the sending module
-    //
+//
+/// set the delay between successive ENRSP responses to NERD
+//
 
-    remoteCANID = getCANID(_msg.id);
+void MLCBbase::setNERDInterval(byte interval_in_millis) {
 
-    //
-    /// if registered, call the user handler with this new frame
-    //
+  _nerd_interval = interval_in_millis;
+}
 
-    if (framehandler != NULL) {
+//
+/// retrieve and process the next received CAN frame
+/// the frame is processed where it lies, in driver or ring storage, and is not modified;
+/// any responses are built in the separate _msg transmit buffer
+//
 
-      // check if incoming opcode is in the user list, if list length > 0
-      if (_num_opcodes > 0) {
-        for (byte i = 0; i < _num_opcodes; i++) {
-          if (opc == _opcodes[i]) {
-            (void)(*framehandler)(&_msg);
-            break;
-          }
-        }
-      } else {
-        (void)(*framehandler)(&_msg);
-      }
-    }
+void MLCBbase::processFrame(void) {
 
-    //
-    /// pulse the green LED
-    //
+  CANFrame *msg = peekFrame();
 
-    if (UI) {
-      _ledGrn.pulse();
-    }
+  if (msg == NULL) {
+    return;
+  }
 
-    // is this a CANID enumeration request from another node (RTR set) ?
-    if (_msg.rtr) {
-      // send an empty message to show our CANID
-      _msg.len = 0;
-      sendMessage(&_msg);
-      continue;
-    }
+  _rxframe = msg;
+  processReceivedFrame(msg);
+  _rxframe = &_msg;
 
-    //
-    /// set flag if we find a CANID conflict with the frame's producer
-    /// doesn't apply to RTR or zero-length frames, so as not to trigger an enumeration loop
-    //
+  consumeFrame();
+}
 
-    if (remoteCANID == module_config->CANID && _msg.len > 0) {
-      enumeration_required = true;
-    }
+//
+/// zero-copy access to the next received frame
+/// returns a pointer to the frame in the receive ring, or NULL if there is none
+/// without a ring, the frame is copied once from getNextMessage(); derived classes with their own
+/// frame storage may override this method and consumeFrame() to avoid that copy
+/// the frame remains valid until consumeFrame() is called
+//
+
+CANFrame *MLCBbase::peekFrame(void) {
+
+  if (_rxring.allocated()) {
+    return _rxring.peek();
+  }
 
-    // is this an extended frame ? we currently ignore these as bootloader, etc data may confuse us !
-    if (_msg.ext) {
-      continue;
+  if (!_rxcopy_valid) {
+    if (!available()) {
+      return NULL;
     }
 
-    // are we enumerating CANIDs ?
-    if (enumeration_active && _msg.len == 0) {
+    _rxcopy = getNextMessage();
+    _rxcopy_valid = true;
+  }
 
-      // store this response in the responses array
-      if (remoteCANID > 0) {
-        bitWrite(enumeration_responses[(remoteCANID / 16)], remoteCANID % 8, 1);
-      }
+  return &_rxcopy;
+}
 
-      continue;
-    }
+//
+/// release the frame returned by peekFrame()
+//
 
-    //
-    /// process the message opcode
-    /// if we got this far, it's a standard CAN frame (not extended, not RTR) with a data payload length > 0
-    //
+void MLCBbase::consumeFrame(void) {
 
-    if (_msg.len > 0) {
+  if (_rxring.allocated()) {
+    _rxring.pop();
+  } else {
+    _rxcopy_valid = false;
+  }
+}
 
-      byte index;
+//
+/// process a received CAN frame
+//
 
-      switch (opc) {
+void MLCBbase::processReceivedFrame(CANFrame *msg) {
 
-      case OPC_ACON:
-      case OPC_ACON1:
-      case OPC_ACON2:
-      case OPC_ACON3:
+  byte remoteCANID, opc;
 
-      case OPC_ACOF:
-      case OPC_ACOF1:
-      case OPC_ACOF2:
-      case OPC_ACOF3:
+  ++_frames_received;
+  opc = msg->data[0];
 
-      case OPC_ARON:
-      case OPC_AROF:
+  //
+  /// extract the CANID of the sending module
+  //
 
-        // lookup this accessory event in the event table and call the user's registered callback function
-        if (eventhandler || eventhandlerex) {
-          processAccessoryEvent(nn, en, (opc % 2 == 0));
-        }
+  remoteCANID = getCANID(msg->id);
 
-        break;
+  //
+  /// if registered, call the user handler with this new frame, if the user is interested in this opcode
+  //
 
-      case OPC_ASON:
-      case OPC_ASON1:
-      case OPC_ASON2:
-      case OPC_ASON3:
+  if (framehandler != NULL && bitRead(_framehandler_opcodes[opc / 8], opc % 8)) {
+    (void)(*framehandler)(msg);
+  }
 
-      case OPC_ASOF:
-      case OPC_ASOF1:
-      case OPC_ASOF2:
-      case OPC_ASOF3:
+  //
+  /// pulse the green LED
+  //
 
-        // lookup this accessory event in the event table and call the user's registered callback function
-        if (eventhandler || eventhandlerex) {
-          processAccessoryEvent(0, en, (opc % 2 == 0));
-        }
+  if (UI) {
+    _ledGrn.pulse();
+  }
 
-        break;
-
-      case OPC_RQNP:
-        // RQNP message - request for node paramters -- does not contain a NN or EN, so only respond if we
-        // are in transition to FLiM
-
-        // only respond if we are in transition to FLiM mode
-        if (mode_changing == true) {
-
-          // respond with PARAMS message
-          _msg.len = 8;
-          _msg.data[0] = OPC_PARAMS;    // opcode
-          _msg.data[1] = _mparams[1];     // manf code -- MERG
-          _msg.data[2] = _mparams[2];     // minor code ver
-          _msg.data[3] = _mparams[3];     // module ident
-          _msg.data[4] = _mparams[4];     // number of events
-          _msg.data[5] = _mparams[5];     // events vars per event
-          _msg.data[6] = _mparams[6];     // number of NVs
-          _msg.data[7] = _mparams[7];     // major code ver
-          sendMessage(&_msg);
-        }
+  // is this a CANID enumeration request from another node (RTR set) ?
+  if (msg->rtr) {
+    // send an empty message to show our CANID
+    _msg.len = 0;
+    queueReply(&_msg);
+    return;
+  }
 
-        break;
+  //
+  /// set flag if we find a CANID conflict with the frame's producer
+  /// doesn't apply to RTR or zero-length frames, so as not to trigger an enumeration loop
+  //
 
-      case OPC_RQNPN:
-        // RQNPN message -- request parameter by index number
-        // index 0 = number of params available;
-        // respond with PARAN
+  if (remoteCANID == module_config->CANID && msg->len > 0) {
+    enumeration_required = true;
+  }
 
-        if (nn == module_config->nodeNum) {
+  // is this an extended frame ? we currently ignore these as bootloader, etc data may confuse us !
+  if (msg->ext) {
+    return;
+  }
 
-          byte paran = _msg.data[3];
+  // are we enumerating CANIDs ?
+  if (enumeration_active && msg->len == 0) {
 
-          if (paran <= _mparams[0]) {
-            paran = _msg.data[3];
+    // store this response in the responses array
+    if (remoteCANID > 0) {
+      bitWrite(enumeration_responses[(remoteCANID / 16)], remoteCANID % 8, 1);
+    }
 
-            _msg.len = 5;
-            _msg.data[0] = OPC_PARAN;
-            _msg.data[3] = paran;
-            _msg.data[4] = _mparams[paran];
-            sendMessage(&_msg);
+    return;
+  }
 
-          } else {
-            sendCMDERR(9);
-          }
-        }
+  //
+  /// process the message opcode
+  /// if we got this far, it's a standard CAN frame (not extended, not RTR) with a data payload length > 0
+  //
 
-        break;
+  if (msg->len > 0) {
+    dispatchOpcode(msg);
+  }
+}
 
-      case OPC_SNN:
-        // received SNN - set node number
+//
+/// housekeeping after frames are processed -- enumeration and FLiM transition timers
+//
 
-        if (mode_changing) {
-          // save the NN
-          module_config->setNodeNum(nn);
-          ++_numNNchanges;
+void MLCBbase::processTimeouts(void) {
 
-          // respond with NNACK
-          _msg.len = 3;
-          _msg.data[0] = OPC_NNACK;
-          sendMessage(&_msg);
+  // check CAN bus enumeration timer
+  check_enumeration();
 
-          // we are now in FLiM mode - update the configuration
-          mode_changing = false;
-          module_config->setFLiM(true);
-          indicateMode(module_config->FLiM);
+  //
+  /// check 30 sec timeout for SLiM/FLiM negotiation with FCU
+  //
 
-          // enumerate the CAN bus to allocate a free CAN ID
-          enumeration_required = true;
-        } else {
-          // DEBUG_SERIAL << F("> received SNN but not in transition") << endl;
-        }
+  if (mode_changing && ((millis() - timeout_timer) >= 30000)) {
+    indicateMode(module_config->FLiM);
+    mode_changing = false;
 
-        break;
+    /// per MLCB MNS -- send an NNACK if keeping previous node number > 0
+    if (module_config->FLiM && module_config->nodeNum > 0) {
+      _msg.len = 3;
+      _msg.data[0] = OPC_NNACK;
+      _msg.data[1] = highByte(module_config->nodeNum);
+      _msg.data[2] = lowByte(module_config->nodeNum);
+      queueReply(&_msg);
+    }
+  }
 
-      case OPC_CANID:
-        // CAN -- set CANID
+  //
+  /// end of MLCB message processing
+  //
 
-        if (nn == module_config->nodeNum) {
-          // DEBUG_SERIAL << F("> setting my CANID to ") << _msg.data[3] << endl;
-          if (_msg.data[3] < 1 || _msg.data[3] > 99) {
-            sendCMDERR(7);
-          } else {
-            module_config->setCANID(_msg.data[3]);
-          }
-        }
+  return;
+}
 
-        break;
+//
+/// opcode dispatch
+/// each opcode maps to an entry in the handler table, via a 256 entry lookup table held in program memory
+/// a user handler registered for an opcode takes precedence over the library's own handler
+//
 
-      case OPC_ENUM:
-        // received ENUM -- start CAN bus self-enumeration
+enum {
+  OPH_NONE = 0,
+  OPH_LONG_EVENT,
+  OPH_SHORT_EVENT,
+  OPH_RQNP,
+  OPH_RQNPN,
+  OPH_SNN,
+  OPH_CANID,
+  OPH_ENUM,
+  OPH_NVRD,
+  OPH_NVSET,
+  OPH_NNLRN,
+  OPH_EVULN,
+  OPH_NNULN,
+  OPH_RQEVN,
+  OPH_NERD,
+  OPH_REVAL,
+  OPH_NNCLR,
+  OPH_NNEVN,
+  OPH_QNN,
+  OPH_RQMN,
+  OPH_EVLRN,
+  OPH_AREQ,
+  OPH_DTXC,
+  OPH_MODE,
+  OPH_RDGN,
+  OPH_RQSD,
+  OPH_REQEV
+};
+
+// handlers, in the same order as the enum above, less OPH_NONE
+
+const MLCBbase::opcodehandler_t MLCBbase::_opcode_handlers[] PROGMEM = {
+  &MLCBbase::handleLongEvent,
+  &MLCBbase::handleShortEvent,
+  &MLCBbase::handleRQNP,
+  &MLCBbase::handleRQNPN,
+  &MLCBbase::handleSNN,
+  &MLCBbase::handleCANID,
+  &MLCBbase::handleENUM,
+  &MLCBbase::handleNVRD,
+  &MLCBbase::handleNVSET,
+  &MLCBbase::handleNNLRN,
+  &MLCBbase::handleEVULN,
+  &MLCBbase::handleNNULN,
+  &MLCBbase::handleRQEVN,
+  &MLCBbase::handleNERD,
+  &MLCBbase::handleREVAL,
+  &MLCBbase::handleNNCLR,
+  &MLCBbase::handleNNEVN,
+  &MLCBbase::handleQNN,
+  &MLCBbase::handleRQMN,
+  &MLCBbase::handleEVLRN,
+  &MLCBbase::handleAREQ,
+  &MLCBbase::handleDTXC,
+  &MLCBbase::handleMODE,
+  &MLCBbase::handleRDGN,
+  &MLCBbase::handleRQSD,
+  &MLCBbase::handleREQEV
+};
+
+// opcode -> handler lookup table
+
+const byte MLCBbase::_opcode_dispatch[256] PROGMEM = {
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x00
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_QNN,         OPH_NONE,        OPH_NONE,   // 0x08
+  OPH_RQNP,        OPH_RQMN,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x10
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x18
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x20
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x28
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x30
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x38
+  OPH_NONE,        OPH_NONE,        OPH_SNN,         OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x40
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x48
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NNLRN,       OPH_NNULN,       OPH_NNCLR,       OPH_NNEVN,       OPH_NERD,   // 0x50
+  OPH_RQEVN,       OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_ENUM,        OPH_NONE,        OPH_NONE,   // 0x58
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x60
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x68
+  OPH_NONE,        OPH_NVRD,        OPH_NONE,        OPH_RQNPN,       OPH_NONE,        OPH_CANID,       OPH_MODE,        OPH_NONE,   // 0x70
+  OPH_RQSD,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x78
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_RDGN,   // 0x80
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x88
+  OPH_LONG_EVENT,  OPH_LONG_EVENT,  OPH_AREQ,        OPH_LONG_EVENT,  OPH_LONG_EVENT,  OPH_EVULN,       OPH_NVSET,       OPH_NONE,   // 0x90
+  OPH_SHORT_EVENT, OPH_SHORT_EVENT, OPH_NONE,        OPH_NONE,        OPH_REVAL,       OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0x98
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xA0
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xA8
+  OPH_LONG_EVENT,  OPH_LONG_EVENT,  OPH_REQEV,       OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xB0
+  OPH_SHORT_EVENT, OPH_SHORT_EVENT, OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xB8
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xC0
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xC8
+  OPH_LONG_EVENT,  OPH_LONG_EVENT,  OPH_EVLRN,       OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xD0
+  OPH_SHORT_EVENT, OPH_SHORT_EVENT, OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xD8
+  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xE0
+  OPH_NONE,        OPH_DTXC,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xE8
+  OPH_LONG_EVENT,  OPH_LONG_EVENT,  OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xF0
+  OPH_SHORT_EVENT, OPH_SHORT_EVENT, OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,        OPH_NONE,   // 0xF8
+};
+
+void MLCBbase::dispatchOpcode(CANFrame *msg) {
+
+  byte opc = msg->data[0];
+
+  // a user handler overrides the library's handler
+  if (_opcodehandlers != NULL && _opcodehandlers[opc] != NULL) {
+    (void)(*_opcodehandlers[opc])(msg);
+    return;
+  }
 
-        if (nn == module_config->nodeNum && remoteCANID != module_config->CANID && !enumeration_active) {
-          // DEBUG_SERIAL << F("> initiating enumeration") << endl;
-          enumeration_required = true;
-        }
+  byte h = pgm_read_byte(&_opcode_dispatch[opc]);
 
-        break;
+  if (h != OPH_NONE) {
+    opcodehandler_t handler;
+    memcpy_P(&handler, &_opcode_handlers[h - 1], sizeof(handler));
+    (this->*handler)(msg);
+  }
+}
 
-      case OPC_NVRD:
-        // received NVRD -- read NV by index
-        if (nn == module_config->nodeNum) {
+//
+/// extract NN and EN from a frame
+//
 
-          if (nvindex > module_config->EE_NUM_NVS) {
-            sendCMDERR(10);
-          } else {
-            _msg.len = 5;
-            _msg.data[0] = OPC_NVANS;
-            _msg.data[4] = module_config->readNV(_msg.data[3]);
-            sendMessage(&_msg);
-          }
-        }
+static inline unsigned int frameNN(const CANFrame *msg) {
+  return (msg->data[1] << 8) + msg->data[2];
+}
 
-        break;
+static inline unsigned int frameEN(const CANFrame *msg) {
+  return (msg->data[3] << 8) + msg->data[4];
+}
 
-      case OPC_NVSET:
-        // received NVSET -- set NV by index
+//
+/// opcode handlers
+//
 
-        if (nn == module_config->nodeNum) {
-          if (_msg.data[3] > module_config->EE_NUM_NVS) {
-            sendCMDERR(10);
-          } else {
-            module_config->writeNV( _msg.data[3], _msg.data[4]);
-            sendWRACK();
-          }
-        }
+void MLCBbase::handleLongEvent(CANFrame *msg) {
 
-        break;
+  // lookup this accessory event in the event table and call the user's registered callback function
+  if (eventhandler || eventhandlerex || eventhandlerevs) {
+    processAccessoryEvent(frameNN(msg), frameEN(msg), (msg->data[0] % 2 == 0));
+  }
+}
 
-      case OPC_NNLRN:
-        // received NNLRN -- place into learn mode
+void MLCBbase::handleShortEvent(CANFrame *msg) {
 
-        if (nn == module_config->nodeNum) {
-          bLearn = true;
-          bitSet(_mparams[8], 5);
-        }
+  // lookup this accessory event in the event table and call the user's registered callback function
+  if (eventhandler || eventhandlerex || eventhandlerevs) {
+    processAccessoryEvent(0, frameEN(msg), (msg->data[0] % 2 == 0));
+  }
+}
 
-        break;
+void MLCBbase::handleRQNP(CANFrame *msg) {
 
-      case OPC_EVULN:
-        // received EVULN -- unlearn an event, by event number
+  (void)msg;
 
-        // we must be in learn mode
-        if (bLearn == true) {
-          // search for this NN and EN pair
-          index = module_config->findExistingEvent(nn, en);
+  // RQNP message - request for node paramters -- does not contain a NN or EN, so only respond if we
+  // are in transition to FLiM
 
-          if (index < module_config->EE_MAX_EVENTS) {
-            module_config->cleareventEEPROM(j);
-            // update hash table
-            module_config->updateEvHashEntry(j);
-            // respond with WRACK
-            sendWRACK();
+  // only respond if we are in transition to FLiM mode
+  if (mode_changing == true) {
 
-          } else {
-            sendCMDERR(10);
-          }
+    // respond with PARAMS message
+    _msg.len = 8;
+    _msg.data[0] = OPC_PARAMS;    // opcode
+    _msg.data[1] = _mparams[1];     // manf code -- MERG
+    _msg.data[2] = _mparams[2];     // minor code ver
+    _msg.data[3] = _mparams[3];     // module ident
+    _msg.data[4] = _mparams[4];     // number of events
+    _msg.data[5] = _mparams[5];     // events vars per event
+    _msg.data[6] = _mparams[6];     // number of NVs
+    _msg.data[7] = _mparams[7];     // major code ver
+    queueReply(&_msg);
+  }
+}
 
-        } // if in learn mode
+void MLCBbase::handleRQNPN(CANFrame *msg) {
 
-        break;
+  // RQNPN message -- request parameter by index number
+  // index 0 = number of params available;
+  // respond with PARAN
 
-      case OPC_NNULN:
-        // received NNULN -- exit from learn mode
+  if (frameNN(msg) == module_config->nodeNum) {
 
-        if (nn == module_config->nodeNum) {
-          bLearn = false;
-          bitClear(_mparams[8], 5);
-        }
+    byte paran = msg->data[3];
 
-        break;
+    if (paran <= _mparams[0]) {
+      _msg.len = 5;
+      _msg.data[0] = OPC_PARAN;
+      _msg.data[1] = highByte(module_config->nodeNum);
+      _msg.data[2] = lowByte(module_config->nodeNum);
+      _msg.data[3] = paran;
+      _msg.data[4] = _mparams[paran];
+      queueReply(&_msg);
 
-      case OPC_RQEVN:
-        // received RQEVN -- request for number of stored events
+    } else {
+      sendCMDERR(9);
+    }
+  }
+}
 
-        if (nn == module_config->nodeNum) {
-          _msg.len = 4;
-          _msg.data[0] = OPC_NUMEV;
-          _msg.data[3] = module_config->numEvents();
-          sendMessage(&_msg);
-        }
+void MLCBbase::handleSNN(CANFrame *msg) {
 
-        break;
+  // received SNN - set node number
 
-      case OPC_NERD:
-        // request for all stored events
+  if (mode_changing) {
+    // save the NN
+    module_config->setNodeNum(frameNN(msg));
+    ++_numNNchanges;
 
-        if (nn == module_config->nodeNum) {
-          _msg.len = 8;
-          _msg.data[0] = OPC_ENRSP;                       // response opcode
-          _msg.data[1] = highByte(module_config->nodeNum);        // my NN hi
-          _msg.data[2] = lowByte(module_config->nodeNum);         // my NN lo
+    // respond with NNACK
+    _msg.len = 3;
+    _msg.data[0] = OPC_NNACK;
+    _msg.data[1] = highByte(module_config->nodeNum);
+    _msg.data[2] = lowByte(module_config->nodeNum);
+    queueReply(&_msg);
 
-          for (byte i = 0; i < module_config->EE_MAX_EVENTS; i++) {
+    // we are now in FLiM mode - update the configuration
+    mode_changing = false;
+    module_config->setFLiM(true);
+    indicateMode(module_config->FLiM);
 
-            if (module_config->getEvTableEntry(i) != 0) {
-              module_config->readEvent(i, &_msg.data[3]);
-              _msg.data[7] = i;                           // event table index
-              sendMessage(&_msg);
-              delay(10);
+    // enumerate the CAN bus to allocate a free CAN ID
+    enumeration_required = true;
+  } else {
+    // DEBUG_SERIAL << F("> received SNN but not in transition") << endl;
+  }
+}
 
-            } // valid stored ev
-          } // loop each ev
-        } // for me
+void MLCBbase::handleCANID(CANFrame *msg) {
 
-        break;
+  // CAN -- set CANID
 
-      case OPC_REVAL:
-        // received REVAL -- request read of an event variable by event index and ev num
-        // respond with NEVAL
+  if (frameNN(msg) == module_config->nodeNum) {
+    // DEBUG_SERIAL << F("> setting my CANID to ") << msg->data[3] << endl;
+    if (msg->data[3] < 1 || msg->data[3] > 99) {
+      sendCMDERR(7);
+    } else {
+      module_config->setCANID(msg->data[3]);
+    }
+  }
+}
 
-        if (nn == module_config->nodeNum) {
+void MLCBbase::handleENUM(CANFrame *msg) {
 
-          if (module_config->getEvTableEntry(_msg.data[3]) != 0) {
-            _msg.len = 6;
-            _msg.data[0] = OPC_NEVAL;
-            _msg.data[5] = module_config->getEventEVval(_msg.data[3], _msg.data[4]);
-            sendMessage(&_msg);
-          } else {
-            sendCMDERR(6);
-          }
+  // received ENUM -- start CAN bus self-enumeration
 
-        }
+  if (frameNN(msg) == module_config->nodeNum && getCANID(msg->id) != module_config->CANID && !enumeration_active) {
+    // DEBUG_SERIAL << F("> initiating enumeration") << endl;
+    enumeration_required = true;
+  }
+}
 
-        break;
+void MLCBbase::handleNVRD(CANFrame *msg) {
 
-      case OPC_NNCLR:
-        // NNCLR -- clear all stored events
+  // received NVRD -- read NV by index
+  if (frameNN(msg) == module_config->nodeNum) {
 
-        if (bLearn == true && nn == module_config->nodeNum) {
-          for (byte e = 0; e < module_config->EE_MAX_EVENTS; e++) {
-            module_config->cleareventEEPROM(e);
-          }
+    if (msg->data[3] > module_config->EE_NUM_NVS) {
+      sendCMDERR(10);
+    } else {
+      _msg.len = 5;
+      _msg.data[0] = OPC_NVANS;
+      _msg.data[1] = highByte(module_config->nodeNum);
+      _msg.data[2] = lowByte(module_config->nodeNum);
+      _msg.data[3] = msg->data[3];
+      _msg.data[4] = module_config->readNV(msg->data[3]);
+      queueReply(&_msg);
+    }
+  }
+}
 
-          module_config->clearEvHashTable();
-          sendWRACK();
-        }
+void MLCBbase::handleNVSET(CANFrame *msg) {
 
-        break;
+  // received NVSET -- set NV by index
 
-      case OPC_NNEVN:
-        // request for number of free event slots
+  if (frameNN(msg) == module_config->nodeNum) {
+    if (msg->data[3] > module_config->EE_NUM_NVS) {
+      sendCMDERR(10);
+    } else {
+      module_config->writeNV(msg->data[3], msg->data[4]);
+      sendWRACK();
+    }
+  }
+}
 
-        if (module_config->nodeNum == nn) {
-          byte free_slots = 0;
+void MLCBbase::handleNNLRN(CANFrame *msg) {
 
-          // count free slots using the event hash table
-          for (byte i = 0; i < module_config->EE_MAX_EVENTS; i++) {
-            if (module_config->getEvTableEntry(i) == 0) {
-              ++free_slots;
-            }
-          }
+  // received NNLRN -- place into learn mode
 
-          _msg.len = 4;
-          _msg.data[0] = OPC_EVNLF;
-          _msg.data[3] = free_slots;
-          sendMessage(&_msg);
-        }
+  if (frameNN(msg) == module_config->nodeNum) {
+    bLearn = true;
+    bitSet(_mparams[8], 5);
+  }
+}
 
-        break;
-
-      case OPC_QNN:
-        // this is probably a config recreate -- respond with PNN if we have a node number
-        if (module_config->nodeNum > 0) {
-          _msg.len = 6;
-          _msg.data[0] = OPC_PNN;
-          _msg.data[1] = highByte(module_config->nodeNum);
-          _msg.data[2] = lowByte(module_config->nodeNum);
-          _msg.data[3] = _mparams[1];
-          _msg.data[4] = _mparams[3];
-          _msg.data[5] = _mparams[8];
-          sendMessage(&_msg);
-        }
+void MLCBbase::handleEVULN(CANFrame *msg) {
 
-        break;
+  // received EVULN -- unlearn an event, by event number
 
-      case OPC_RQMN:
-        // request for node module name, excluding "CAN" prefix
-        // sent during module transition, so no node number check
-        // only respond if in transition to FLiM
+  // we must be in learn mode
+  if (bLearn == true) {
+    // search for this NN and EN pair
+    byte index = module_config->findExistingEvent(frameNN(msg), frameEN(msg));
 
-        // respond with NAME
-        if (mode_changing) {
-          _msg.len = 8;
-          _msg.data[0] = OPC_NAME;
-          memcpy(_msg.data + 1, _mname, 7);
-          sendMessage(&_msg);
-        }
+    if (index < module_config->EE_MAX_EVENTS) {
+      module_config->cleareventEEPROM(index);
+      // update hash table
+      module_config->updateEvHashEntry(index);
+      // respond with WRACK
+      sendWRACK();
 
-        break;
+    } else {
+      sendCMDERR(10);
+    }
 
-      case OPC_EVLRN:
-        // received EVLRN -- learn an event
-        evindex = _msg.data[5];
-        evval = _msg.data[6];
+  } // if in learn mode
+}
 
-        // we must be in learn mode
-        if (bLearn == true) {
-          index = module_config->findExistingEvent(nn, en);
+void MLCBbase::handleNNULN(CANFrame *msg) {
 
-          if (index >= module_config->EE_MAX_EVENTS) {
-            index = module_config->findEventSpace();
-          }
+  // received NNULN -- exit from learn mode
 
-          if (index < module_config->EE_MAX_EVENTS) {
+  if (frameNN(msg) == module_config->nodeNum) {
+    bLearn = false;
+    bitClear(_mparams[8], 5);
+  }
+}
 
-            // write the event to EEPROM at this location -- EVs are indexed from 1 but storage offsets start at zero !!
-            // don't repeat this for subsequent EVs
-            if (evindex < 2) {
-              module_config->writeEvent(index, &_msg.data[1]);
-            }
+void MLCBbase::handleRQEVN(CANFrame *msg) {
 
-            module_config->writeEventEV(index, evindex, evval);
-            // recreate event hash table entry
-            module_config->updateEvHashEntry(index);
-            // respond with WRACK
-            sendWRACK();
+  // received RQEVN -- request for number of stored events
 
-          } else {
-            // respond with CMDERR
-            sendCMDERR(10);
-          }
+  if (frameNN(msg) == module_config->nodeNum) {
+    _msg.len = 4;
+    _msg.data[0] = OPC_NUMEV;
+    _msg.data[1] = highByte(module_config->nodeNum);
+    _msg.data[2] = lowByte(module_config->nodeNum);
+    _msg.data[3] = module_config->numEvents();
+    queueReply(&_msg);
+  }
+}
 
-        } else { // bLearn == true
-        }
+void MLCBbase::handleNERD(CANFrame *msg) {
 
-        break;
+  // request for all stored events
+  // the responses are sent one at a time from process(), so a large event table does not stall the node
+  // a repeated NERD restarts the response from the beginning of the table
 
-      case OPC_AREQ:
-        // AREQ message - request for node state, only producer nodes
+  if (frameNN(msg) == module_config->nodeNum) {
+    _nerd_active = true;
+    _nerd_index = 0;
+    _nerd_last = millis() - _nerd_interval;
+  }
+}
 
-        if (module_config->nodeNum == nn) {
-          (void)(*eventhandler)(0, &_msg);
-        }
+void MLCBbase::handleREVAL(CANFrame *msg) {
 
-        break;
+  // received REVAL -- request read of an event variable by event index and ev num
+  // respond with NEVAL
 
-      case OPC_BOOT:
-        // boot mode
-        break;
+  if (frameNN(msg) == module_config->nodeNum) {
 
-      case OPC_RSTAT:
-        // command station status -- not applicable to accessory modules
-        break;
+    if (module_config->getEvTableEntry(msg->data[3]) != 0) {
+      _msg.len = 6;
+      _msg.data[0] = OPC_NEVAL;
+      _msg.data[1] = highByte(module_config->nodeNum);
+      _msg.data[2] = lowByte(module_config->nodeNum);
+      _msg.data[3] = msg->data[3];
+      _msg.data[4] = msg->data[4];
+      _msg.data[5] = module_config->getEventEVval(msg->data[3], msg->data[4]);
+      queueReply(&_msg);
+    } else {
+      sendCMDERR(6);
+    }
+  }
+}
 
-      case OPC_DTXC:
-        // MLCB multipart message
-        if (MultipartMessageHandler != NULL) {
-          MultipartMessageHandler->processReceivedMessageFragment(&_msg);
-        }
-        break;
+void MLCBbase::handleNNCLR(CANFrame *msg) {
 
-      /// new opcodes for MLCB MNS
+  // NNCLR -- clear all stored events
 
-      case OPC_MODE:
-        if (module_config->nodeNum == nn) {
-          Serial << F("> got OPC_MODE") << endl;
-        }
+  if (bLearn == true && frameNN(msg) == module_config->nodeNum) {
+    module_config->beginTransaction();
 
-        break;
-
-      case OPC_RDGN:
-        if (module_config->nodeNum == nn) {
-          Serial << F("> got OPC_RDGN") << endl;
-          byte service_num = _msg.data[3];
-          byte data1 = 0;
-          byte data2 = 0;
-
-          switch (_msg.data[4]) {
-          case 2:
-            data1 = millis() >> 24;
-            data2 = millis() >> 16;
-            break;
-          case 3:
-            data1 = millis() >> 8;
-            data2 = millis() & 0xff;
-            break;
-          case 5:
-            data1 = _numNNchanges >> 8;
-            data2 = _numNNchanges & 0xff;
-            break;
-          case 7:
-            data1 = _numMsgsActioned >> 8;
-            data2 = _numMsgsActioned & 0xff;
-            break;
-          }
+    for (byte e = 0; e < module_config->EE_MAX_EVENTS; e++) {
+      module_config->cleareventEEPROM(e);
+    }
 
-          _msg.len = 5;
-          _msg.data[0] = OPC_DGN;
-          _msg.data[1] = highByte(module_config->nodeNum);
-          _msg.data[2] = lowByte(module_config->nodeNum);
-          _msg.data[3] = data1;
-          _msg.data[4] = data2;
-          sendMessage(&_msg);
-        }
+    module_config->commit();
 
-        break;
+    module_config->clearEvHashTable();
+    sendWRACK();
+  }
+}
 
-      case OPC_RQSD:
-        if (module_config->nodeNum == nn) {
-          Serial << F("> got OPC_RDGN") << endl;
-          // byte service_num = _msg.data[3];
-          // byte diag_code = _msg.data[4];
-        }
+void MLCBbase::handleNNEVN(CANFrame *msg) {
 
-        break;
+  // request for number of free event slots
 
-      case OPC_REQEV:
-        if (module_config->nodeNum == nn) {
-          Serial << F("> got OPC_REQEV") << endl;
-        }
+  if (module_config->nodeNum == frameNN(msg)) {
+    _msg.len = 4;
+    _msg.data[0] = OPC_EVNLF;
+    _msg.data[1] = highByte(module_config->nodeNum);
+    _msg.data[2] = lowByte(module_config->nodeNum);
+    _msg.data[3] = module_config->numFreeEvents();
+    queueReply(&_msg);
+  }
+}
+
+void MLCBbase::handleQNN(CANFrame *msg) {
+
+  (void)msg;
 
-        break;
+  // this is probably a config recreate -- respond with PNN if we have a node number
+  if (module_config->nodeNum > 0) {
+    _msg.len = 6;
+    _msg.data[0] = OPC_PNN;
+    _msg.data[1] = highByte(module_config->nodeNum);
+    _msg.data[2] = lowByte(module_config->nodeNum);
+    _msg.data[3] = _mparams[1];
+    _msg.data[4] = _mparams[3];
+    _msg.data[5] = _mparams[8];
+    queueReply(&_msg);
+  }
+}
+
+void MLCBbase::handleRQMN(CANFrame *msg) {
+
+  (void)msg;
+
+  // request for node module name, excluding "CAN" prefix
+  // sent during module transition, so no node number check
+  // only respond if in transition to FLiM
+
+  // respond with NAME
+  if (mode_changing) {
+    _msg.len = 8;
+    _msg.data[0] = OPC_NAME;
+    memcpy(_msg.data + 1, _mname, 7);
+    queueReply(&_msg);
+  }
+}
+
+void MLCBbase::handleEVLRN(CANFrame *msg) {
+
+  // received EVLRN -- learn an event
+  byte evindex = msg->data[5];
+  byte evval = msg->data[6];
+
+  // we must be in learn mode
+  if (bLearn == true) {
+    byte index = module_config->findExistingEvent(frameNN(msg), frameEN(msg));
 
-      default:
-        // unknown or unhandled OPC
-        break;
+    if (index >= module_config->EE_MAX_EVENTS) {
+      index = module_config->findEventSpace();
+    }
+
+    if (index < module_config->EE_MAX_EVENTS) {
+
+      // write the event to EEPROM at this location -- EVs are indexed from 1 but storage offsets start at zero !!
+      // don't repeat this for subsequent EVs
+      module_config->beginTransaction();
+
+      if (evindex < 2) {
+        module_config->writeEvent(index, &msg->data[1]);
       }
+
+      module_config->writeEventEV(index, evindex, evval);
+      module_config->commit();
+      // recreate event hash table entry
+      module_config->updateEvHashEntry(index);
+      // respond with WRACK
+      sendWRACK();
+
     } else {
+      // respond with CMDERR
+      sendCMDERR(10);
     }
-  }  // while messages available
+  }
+}
 
-  // check CAN bus enumeration timer
-  check_enumeration();
+void MLCBbase::handleAREQ(CANFrame *msg) {
 
-  //
-  /// check 30 sec timeout for SLiM/FLiM negotiation with FCU
-  //
+  // AREQ message - request for node state, only producer nodes
 
-  if (mode_changing && ((millis() - timeout_timer) >= 30000)) {
-    indicateMode(module_config->FLiM);
-    mode_changing = false;
+  if (module_config->nodeNum == frameNN(msg) && eventhandler != NULL) {
+    (void)(*eventhandler)(0, msg);
+  }
+}
 
-    /// per MLCB MNS -- send an NNACK if keeping previous node number > 0
-    if (module_config->FLiM && module_config->nodeNum > 0) {
-      _msg.len = 3;
-      _msg.data[0] = OPC_NNACK;
-      _msg.data[1] = highByte(module_config->nodeNum);
-      _msg.data[2] = lowByte(module_config->nodeNum);
-      sendMessage(&_msg);
+void MLCBbase::handleDTXC(CANFrame *msg) {
+
+  // MLCB multipart message
+  if (MultipartMessageHandler != NULL) {
+    MultipartMessageHandler->processReceivedMessageFragment(msg);
+  }
+}
+
+/// new opcodes for MLCB MNS
+
+void MLCBbase::handleMODE(CANFrame *msg) {
+
+  if (module_config->nodeNum == frameNN(msg)) {
+    Serial << F("> got OPC_MODE") << endl;
+  }
+}
+
+void MLCBbase::handleRDGN(CANFrame *msg) {
+
+  if (module_config->nodeNum == frameNN(msg)) {
+    Serial << F("> got OPC_RDGN") << endl;
+    // byte service_num = msg->data[3];
+    byte data1 = 0;
+    byte data2 = 0;
+
+    switch (msg->data[4]) {
+    case 2:
+      data1 = millis() >> 24;
+      data2 = millis() >> 16;
+      break;
+    case 3:
+      data1 = millis() >> 8;
+      data2 = millis() & 0xff;
+      break;
+    case 5:
+      data1 = _numNNchanges >> 8;
+      data2 = _numNNchanges & 0xff;
+      break;
+    case 7:
+      data1 = _numMsgsActioned >> 8;
+      data2 = _numMsgsActioned & 0xff;
+      break;
     }
+
+    _msg.len = 5;
+    _msg.data[0] = OPC_DGN;
+    _msg.data[1] = highByte(module_config->nodeNum);
+    _msg.data[2] = lowByte(module_config->nodeNum);
+    _msg.data[3] = data1;
+    _msg.data[4] = data2;
+    queueReply(&_msg);
   }
+}
 
-  //
-  /// end of MLCB message processing
-  //
+void MLCBbase::handleRQSD(CANFrame *msg) {
 
-  return;
+  if (module_config->nodeNum == frameNN(msg)) {
+    Serial << F("> got OPC_RQSD") << endl;
+    // byte service_num = msg->data[3];
+    // byte diag_code = msg->data[4];
+  }
+}
+
+void MLCBbase::handleREQEV(CANFrame *msg) {
+
+  if (module_config->nodeNum == frameNN(msg)) {
+    Serial << F("> got OPC_REQEV") << endl;
+  }
 }
 
 void MLCBbase::check_enumeration(void) {
@@ -1005,7 +1373,7 @@ check_done:
     _msg.data[0] = OPC_NNACK;
     _msg.data[1] = highByte(module_config->nodeNum);
     _msg.data[2] = lowByte(module_config->nodeNum);
-    sendMessage(&_msg);
+    queueReply(&_msg);
   }
 }
 
@@ -1022,15 +1390,163 @@ void MLCBbase::processAccessoryEvent(unsigned int nn, unsigned int en, bool is_o
 
   if (index < module_config->EE_MAX_EVENTS) {
     if (eventhandler != NULL) {
-      (void)(*eventhandler)(index, & _msg);
+      (void)(*eventhandler)(index, _rxframe);
     } else if (eventhandlerex != NULL) {
-      (void)(*eventhandlerex)(index, & _msg, is_on_event, \
+      (void)(*eventhandlerex)(index, _rxframe, is_on_event, \
                               ((module_config->EE_NUM_EVS > 0) ? module_config->getEventEVval(index, 1) : 0) \
                              );
+    } else if (eventhandlerevs != NULL) {
+      // the handler is given no EVs if they could not all be read
+      const byte *evs = (module_config->EE_NUM_EVS > 0 && module_config->EE_NUM_EVS <= _evbuf_len) ? module_config->getEventEVs(index, _evbuf) : NULL;
+      (void)(*eventhandlerevs)(index, _rxframe, is_on_event, evs, (evs != NULL) ? module_config->EE_NUM_EVS : 0);
+    }
+  }
+}
+
+//
+/// allocate the transmit queue
+/// once allocated, frames sent by the library are queued in MLCB priority order and the queue is drained
+/// as the CAN controller accepts them; frames it refuses are retried on the next call to process()
+//
+
+bool MLCBbase::allocateTxQueue(byte depth) {
+
+  if (_txq != NULL || depth == 0) {
+    return false;
+  }
+
+  if ((_txq = (tx_queue_entry_t *)malloc(depth * sizeof(tx_queue_entry_t))) == NULL) {
+    return false;
+  }
+
+  _txq_size = depth;
+  _txq_count = 0;
+  return true;
+}
+
+//
+/// send a frame via the transmit queue, or directly if there is no queue
+/// the frame is copied, so the caller's buffer may be reused immediately
+/// the queue is kept in send order: the next frame to send is at the end of the array
+/// priorities are the 4 bit MLCB priority, so lower values are more urgent, as in CAN arbitration;
+/// frames of equal priority are sent in the order they were queued
+/// when the queue is full the new frame is rejected; frames already accepted are never dropped
+/// returns false if the frame was rejected
+//
+
+bool MLCBbase::queueMessage(CANFrame *msg, bool rtr, bool ext, byte priority) {
+
+  return enqueueFrame(msg, rtr, ext, priority, false);
+}
+
+//
+/// send one of the library's own replies, at the default priority
+/// within the queue, replies go ahead of other frames of the same priority, such as multipart fragments,
+/// but the priority on the bus is unchanged
+//
+
+bool MLCBbase::queueReply(CANFrame *msg, bool rtr) {
+
+  return enqueueFrame(msg, rtr, false, DEFAULT_PRIORITY, true);
+}
+
+//
+/// add a frame to the transmit queue, in send order, or send it directly if there is no queue
+//
+
+bool MLCBbase::enqueueFrame(CANFrame *msg, bool rtr, bool ext, byte priority, bool reply) {
+
+  if (_txq == NULL) {
+    return sendMessage(msg, rtr, ext, priority);
+  }
+
+  if (_txq_count >= _txq_size) {
+    ++_txq_drops;
+    return false;
+  }
+
+  // the send order is the priority, with replies in the more urgent half of each priority level
+  byte order = (byte)((priority << 1) | (reply ? 0 : 1));
+
+  // find the insertion point -- after all less urgent frames, before those of equal or higher order
+  byte pos = 0;
+
+  while (pos < _txq_count && _txq[pos].order > order) {
+    ++pos;
+  }
+
+  memmove(&_txq[pos + 1], &_txq[pos], (_txq_count - pos) * sizeof(tx_queue_entry_t));
+
+  _txq[pos].frame = *msg;
+  _txq[pos].frame.rtr = rtr;
+  _txq[pos].frame.ext = ext;
+  _txq[pos].priority = priority;
+  _txq[pos].order = order;
+  _txq[pos].queued_at = micros();
+  ++_txq_count;
+
+  if (_txq_count > _txq_highwater) {
+    _txq_highwater = _txq_count;
+  }
+
+  processTxQueue();
+  return true;
+}
+
+//
+/// send queued frames, most urgent first, until the queue is empty or the CAN controller refuses one
+//
+
+void MLCBbase::processTxQueue(void) {
+
+  while (_txq_count > 0) {
+    tx_queue_entry_t *entry = &_txq[_txq_count - 1];
+
+    if (!sendMessage(&entry->frame, entry->frame.rtr, entry->frame.ext, entry->priority)) {
+      ++_txq_retries;
+      break;
+    }
+
+    unsigned long wait = micros() - entry->queued_at;
+
+    if (wait > _txq_max_wait) {
+      _txq_max_wait = wait;
     }
+
+    _txq_total_wait += wait;
+    ++_txq_sent;
+    --_txq_count;
   }
 }
 
+//
+/// transmit queue statistics
+//
+
+byte MLCBbase::txQueueDepth(void) {
+  return _txq_count;
+}
+
+byte MLCBbase::txQueueHighwater(void) {
+  return _txq_highwater;
+}
+
+unsigned int MLCBbase::txQueueDrops(void) {
+  return _txq_drops;
+}
+
+unsigned int MLCBbase::txQueueRetries(void) {
+  return _txq_retries;
+}
+
+unsigned long MLCBbase::txQueueMaxWait(void) {
+  return _txq_max_wait;
+}
+
+unsigned long MLCBbase::txQueueAverageWait(void) {
+  return (_txq_sent > 0) ? (_txq_total_wait / _txq_sent) : 0;
+}
+
 //
 /// set the multipart message handler object to receive multipart message frames
 //
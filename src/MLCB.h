@@ -45,14 +45,19 @@
 #include <MLCBLED.h>
 #include <MLCBSwitch.h>
 #include <MLCBConfig.h>
+#include <MLCBCRC.h>
 #include <MLCBdefs.h>
 
 #define SW_TR_HOLD 8000U                           // MLCB push button hold time for SLiM/FLiM transition in millis = 8 seconds
 #define DEFAULT_PRIORITY 0xB                       // default MLCB messages priority. 1011 = 2|3 = normal/low
 #define MULTIPART_MESSAGE_DEFAULT_DELAY 20U        // delay in milliseconds between sending successive long message fragments
 #define MULTIPART_MESSAGE_RECEIVE_TIMEOUT 5000UL   // timeout waiting for next long message packet
+#define MULTIPART_PACING_DEFAULT_MIN_RATE 50U      // lowest adaptive fragment rate per second, the same as the default delay
+#define MULTIPART_PACING_WINDOW 100UL              // interval in milliseconds at which the adaptive fragment rate is adjusted
+#define MULTIPART_PACING_BUSY_RATE 300U            // frames per second received from the bus above which it is considered busy
 #define NUM_EX_CONTEXTS 4U                         // number of send and receive contexts for extended implementation = number of concurrent messages
 #define EX_BUFFER_LEN 64U                          // size of extended send and receive buffers
+#define NERD_DEFAULT_INTERVAL 10U                  // delay in milliseconds between successive ENRSP responses to NERD
 #define HBTIMER_INTERVAL 5000UL                    // heartbeat interval in ms 
 
 //
@@ -92,6 +97,54 @@ public:
   uint8_t data[8] = {};
 };
 
+//
+/// memory barrier for the lock-free ring
+/// AVR is single core and only the compiler needs restraining
+//
+
+#if defined(__AVR__)
+#define MLCB_MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define MLCB_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+//
+/// a single-producer, single-consumer lock-free ring buffer of CAN frames
+/// the producer, e.g. a CAN controller ISR, calls push(); the consumer calls peek() and then pop() once it has finished with the frame
+/// depth must be a power of two, no greater than 128
+//
+
+class CANFrameRing {
+
+public:
+  bool allocate(byte depth);
+  bool allocated(void) { return (_frames != NULL); }
+  bool push(const CANFrame *frame);
+  CANFrame *peek(void);
+  void pop(void);
+  byte count(void);
+  byte depth(void) { return _mask + 1; }
+
+  volatile unsigned int overflows = 0;                       // frames dropped because the ring was full
+  volatile byte highwater = 0;                               // maximum number of frames held
+
+private:
+  CANFrame *_frames = NULL;
+  byte _mask = 0;
+  volatile byte _head = 0, _tail = 0;                        // free-running; head is written only by the producer, tail only by the consumer
+};
+
+//
+/// an entry in the priority-ordered transmit queue
+//
+
+typedef struct _tx_queue_entry_t {
+  CANFrame frame;
+  byte priority;
+  byte order;                                       // send order: the priority, then the library's own replies ahead of other frames
+  unsigned long queued_at;
+} tx_queue_entry_t;
+
 //
 /// an abstract class to encapsulate CAN bus and MLCB processing
 /// it must be implemented by a derived subclass
@@ -128,6 +181,26 @@ public:
   bool isExt(CANFrame *msg);
   bool isRTR(CANFrame *msg);
   void process(byte num_messages = 3);
+  unsigned int processFor(unsigned long budget_micros);
+  // the number of received frames still waiting; exact with a receive ring or a driver override,
+  // otherwise only a hint: 1 if any frame is waiting, else 0
+  virtual unsigned int rxBacklog(void);
+  virtual CANFrame *peekFrame(void);
+  virtual void consumeFrame(void);
+  bool allocateRxRing(byte depth);
+  bool pushReceivedFrame(const CANFrame *frame);
+  unsigned int rxRingOverflows(void) { return _rxring.overflows; }
+  byte rxRingHighwater(void) { return _rxring.highwater; }
+  bool allocateTxQueue(byte depth);
+  bool queueMessage(CANFrame *msg, bool rtr = false, bool ext = false, byte priority = DEFAULT_PRIORITY);
+  void processTxQueue(void);
+  byte txQueueDepth(void);
+  byte txQueueSize(void) { return _txq_size; }
+  byte txQueueHighwater(void);
+  unsigned int txQueueDrops(void);
+  unsigned int txQueueRetries(void);
+  unsigned long txQueueMaxWait(void);
+  unsigned long txQueueAverageWait(void);
   void initFLiM(void);
   void revertSLiM(void);
   void setSLiM(void);
@@ -137,17 +210,32 @@ public:
   void setParams(unsigned char *mparams);
   void setName(unsigned char *mname);
   void indicateMode(byte mode);
+  // only one event handler is active; each call replaces any handler registered by another form
   void setEventHandler(void (*fptr)(byte index, CANFrame *msg));
   void setEventHandler(void (*fptr)(byte index, CANFrame *msg, bool ison, byte evval));
+  bool setEventHandler(void (*fptr)(byte index, CANFrame *msg, bool ison, const byte *evs, byte num_evs));
   void setFrameHandler(void (*fptr)(CANFrame *msg), byte *opcodes = NULL, byte num_opcodes = 0);
+  bool setOpcodeHandler(byte opcode, void (*fptr)(CANFrame *msg));
   void makeHeader(CANFrame *msg, byte priority = DEFAULT_PRIORITY);
   void processAccessoryEvent(unsigned int nn, unsigned int en, bool is_on_event);
   void setMultipartMessageHandler(MLCBMultipartMessage *handler);
+  void setNERDInterval(byte interval_in_millis);
+  bool isNERDActive(void) { return _nerd_active; }
 
   unsigned int _numMsgsSent, _numMsgsRcvd, _numMsgsActioned, _numNNchanges;
+  unsigned long framesReceived(void) { return _frames_received; }
 
 protected:                                          // protected members become private in derived classes
-  CANFrame _msg;
+  CANFrame _msg;                                           // transmit buffer for responses
+  CANFrame *_rxframe = &_msg;                              // the received frame currently being processed
+  CANFrame _rxcopy;                                        // received frame copied from getNextMessage() when there is no zero-copy source
+  bool _rxcopy_valid = false;
+  CANFrameRing _rxring;
+  tx_queue_entry_t *_txq = NULL;                           // transmit queue, ordered with the next frame to send last
+  byte _txq_size = 0, _txq_count = 0, _txq_highwater = 0;
+  unsigned int _txq_drops = 0, _txq_retries = 0, _txq_sent = 0;
+  unsigned long _txq_max_wait = 0, _txq_total_wait = 0;   // microseconds
+  unsigned long _frames_received = 0;                      // all frames received from the bus, a measure of bus load
   MLCBLED _ledGrn, _ledYlw;
   MLCBSwitch _sw;
   MLCBConfig *module_config;
@@ -155,9 +243,12 @@ protected:                                          // protected members become
   unsigned char *_mname;
   void (*eventhandler)(byte index, CANFrame *msg);
   void (*eventhandlerex)(byte index, CANFrame *msg, bool evOn, byte evVal);
+  void (*eventhandlerevs)(byte index, CANFrame *msg, bool evOn, const byte *evs, byte num_evs) = NULL;
+  byte *_evbuf = NULL;                                     // EVs of the matched event, when they are not all cached
+  byte _evbuf_len = 0;
   void (*framehandler)(CANFrame *msg);
-  byte *_opcodes;
-  byte _num_opcodes;
+  byte _framehandler_opcodes[32];                          // 256 bits, one per opcode the frame handler is interested in
+  void (**_opcodehandlers)(CANFrame *msg) = NULL;          // 256 user opcode handlers, allocated on first use
   byte enumeration_responses[16];                          // 128 bits for storing CAN ID enumeration results
   bool mode_changing, enumeration_active, bLearn;
   unsigned long timeout_timer, enumeration_start;
@@ -167,8 +258,58 @@ protected:                                          // protected members become
   bool hbactive;
   uint8_t hbcount;
   uint32_t hbtimer;
+  bool _nerd_active = false;                               // a NERD response is in progress
+  byte _nerd_index = 0;                                    // next event table index to examine
+  byte _nerd_interval = NERD_DEFAULT_INTERVAL;
+  unsigned long _nerd_last = 0UL;
 
   MLCBMultipartMessage *MultipartMessageHandler = NULL;       // MLCB long message object to receive relevant frames
+
+  // message processing
+
+  void processNodeState(void);
+  bool frameAvailable(void);
+  void processFrame(void);
+  void processReceivedFrame(CANFrame *msg);
+  void processTimeouts(void);
+  void processNERD(void);
+  void clearEventHandlers(void);
+  bool queueReply(CANFrame *msg, bool rtr = false);
+  bool enqueueFrame(CANFrame *msg, bool rtr, bool ext, byte priority, bool reply);
+
+  // opcode dispatch
+
+  typedef void (MLCBbase::*opcodehandler_t)(CANFrame *msg);
+  static const opcodehandler_t _opcode_handlers[];
+  static const byte _opcode_dispatch[256];
+  void dispatchOpcode(CANFrame *msg);
+
+  void handleLongEvent(CANFrame *msg);
+  void handleShortEvent(CANFrame *msg);
+  void handleRQNP(CANFrame *msg);
+  void handleRQNPN(CANFrame *msg);
+  void handleSNN(CANFrame *msg);
+  void handleCANID(CANFrame *msg);
+  void handleENUM(CANFrame *msg);
+  void handleNVRD(CANFrame *msg);
+  void handleNVSET(CANFrame *msg);
+  void handleNNLRN(CANFrame *msg);
+  void handleEVULN(CANFrame *msg);
+  void handleNNULN(CANFrame *msg);
+  void handleRQEVN(CANFrame *msg);
+  void handleNERD(CANFrame *msg);
+  void handleREVAL(CANFrame *msg);
+  void handleNNCLR(CANFrame *msg);
+  void handleNNEVN(CANFrame *msg);
+  void handleQNN(CANFrame *msg);
+  void handleRQMN(CANFrame *msg);
+  void handleEVLRN(CANFrame *msg);
+  void handleAREQ(CANFrame *msg);
+  void handleDTXC(CANFrame *msg);
+  void handleMODE(CANFrame *msg);
+  void handleRDGN(CANFrame *msg);
+  void handleRQSD(CANFrame *msg);
+  void handleREQEV(CANFrame *msg);
 };
 
 //
@@ -189,10 +330,22 @@ public:
   bool is_sending(void);
   void setDelay(byte delay_in_millis);
   void setTimeout(unsigned int timeout_in_millis);
+  void setPacing(byte burst, unsigned int max_rate, unsigned int min_rate = MULTIPART_PACING_DEFAULT_MIN_RATE);
+  unsigned int pacingRate(void) { return _pace_rate; }
 
 protected:
 
   bool sendMessageFragment(CANFrame *frame, const byte priority);
+  bool fragmentDue(unsigned long last_fragment_sent);
+  void updatePacing(void);
+  void fragmentSent(bool queued);
+
+  // token bucket pacing of fragments, in units of one millionth of a fragment
+  static const unsigned long PACING_UNIT = 1000000UL;
+  bool _pacing = false, _pace_backpressure = false;
+  byte _pace_burst = 0;
+  unsigned int _pace_rate = 0, _pace_min_rate = 0, _pace_max_rate = 0;        // fragments per second
+  unsigned long _pace_credit = 0, _pace_last_micros = 0, _pace_window_start = 0, _pace_window_frames = 0;
 
   bool _is_receiving = false;
   byte *_send_buffer, *_receive_buffer;
@@ -209,19 +362,26 @@ protected:
 //// extended support for multiple concurrent long messages
 
 // send and receive contexts
+// the fields scanned on every fragment (in use, stream ID and sender CANID) are held in separate arrays of the context pool
 
 typedef struct _receive_context_t {
-  bool in_use;
-  byte receive_stream_id, sender_canid;
   byte *buffer;
   unsigned int receive_buffer_index, incoming_bytes_received, incoming_message_length, expected_next_receive_sequence_num, incoming_message_crc;
   unsigned long last_fragment_received;
+  MLCBCRC16 crc;                // running CRC of the data received so far
 } receive_context_t;
 
+// where the payload of an outgoing message is held
+enum {
+  MULTIPART_SEND_HEAP = 0,      // a heap copy, freed when the message is sent
+  MULTIPART_SEND_POOL,          // a copy in the context's reserved pool slot
+  MULTIPART_SEND_CALLER         // the caller's buffer, which must stay valid until the send complete handler is called
+};
+
 typedef struct _send_context_t {
-  bool in_use;
-  byte send_stream_id, send_priority, msg_delay;
-  byte *buffer;
+  int sched_credit;             // weighted round-robin credit, see MLCBMultipartMessageEx::process()
+  byte send_priority, msg_delay, send_mode;
+  const byte *buffer;
   unsigned int send_buffer_len, send_buffer_index, send_sequence_num;
   unsigned long last_fragment_sent;
 } send_context_t;
@@ -236,10 +396,33 @@ public:
 
   MLCBMultipartMessageEx(MLCBbase *MLCB_object_ptr)
     : MLCBMultipartMessage(MLCB_object_ptr) {}         // derived class constructor calls the base class constructor
+  ~MLCBMultipartMessageEx() { releaseContexts(); }
+
+  // the alignment of the context structs, and the size of the storage needed for a context pool, including slack to align it
+  static constexpr size_t contextAlignment(void) {
+    return (alignof(receive_context_t) > alignof(send_context_t)) ? alignof(receive_context_t) : alignof(send_context_t);
+  }
+
+  static constexpr size_t contextStorageSize(byte num_receive_contexts = NUM_EX_CONTEXTS, unsigned int receive_buffer_len = EX_BUFFER_LEN, byte num_send_contexts = NUM_EX_CONTEXTS) {
+    return contextAlignment() - 1 + ((num_receive_contexts * sizeof(receive_context_t) + contextAlignment() - 1) & ~(contextAlignment() - 1)) + \
+           num_send_contexts * sizeof(send_context_t) + num_receive_contexts * (receive_buffer_len + 5) + num_send_contexts * 3 + \
+           demuxTableSize(num_receive_contexts);
+  }
+
+  // the number of buckets in the receive demultiplexer, the smallest power of two from 4 that is at least the number of receive contexts
+  static constexpr unsigned int demuxTableSize(byte num_receive_contexts, unsigned int size = 4) {
+    return (size >= num_receive_contexts) ? size : demuxTableSize(num_receive_contexts, size * 2);
+  }
 
   bool allocateContexts(byte num_receive_contexts = NUM_EX_CONTEXTS, unsigned int receive_buffer_len = EX_BUFFER_LEN, byte num_send_contexts = NUM_EX_CONTEXTS);
+  bool useContextStorage(void *storage, size_t storage_len, byte num_receive_contexts = NUM_EX_CONTEXTS, unsigned int receive_buffer_len = EX_BUFFER_LEN, byte num_send_contexts = NUM_EX_CONTEXTS);
+  void releaseContexts(void);
+  bool reserveSendBuffers(unsigned int send_buffer_len);
   bool sendMultipartMessage(const void *msg, const unsigned int msg_len, const byte stream_id, const byte priority = DEFAULT_PRIORITY);
+  bool sendMultipartMessageNoCopy(const void *msg, const unsigned int msg_len, const byte stream_id, const byte priority = DEFAULT_PRIORITY);
+  void setSendCompleteHandler(void (*sendcompletehandler)(const void *msg, unsigned int msg_len, byte stream_id));
   bool process(void);
+  void setSendBudget(byte max_fragments);
   void subscribe(byte *stream_ids, const byte num_stream_ids, void (*messagehandler)(void *msg, unsigned int msg_len, byte stream_id, byte status));
   virtual void processReceivedMessageFragment(const CANFrame *frame);
   byte is_sending(void);
@@ -247,9 +430,33 @@ public:
 
 private:
 
+  bool startSend(const void *msg, const unsigned int msg_len, const byte stream_id, const byte priority, const bool copy);
+  void releaseSendContext(byte i);
+  byte nextSendContext(void);
+  bool sendNextFragment(byte i);
+  byte demuxHash(byte canid, byte stream_id) { return ((stream_id * 31) + canid) & _rx_hash_mask; }
+  byte findReceiveContext(byte canid, byte stream_id);
+  byte claimReceiveContext(byte canid, byte stream_id);
+  void releaseReceiveContext(byte i);
+  void layoutContexts(byte *storage, byte num_receive_contexts, unsigned int receive_buffer_len, byte num_send_contexts);
+
   bool _use_crc = false;
-  byte _num_receive_contexts = NUM_EX_CONTEXTS, _num_send_contexts = NUM_EX_CONTEXTS;
-  receive_context_t **_receive_context = NULL;
-  send_context_t **_send_context = NULL;
+  bool _storage_owned = false;                  // the context pool was allocated by allocateContexts() and is freed by releaseContexts()
+  byte _num_receive_contexts = 0, _num_send_contexts = 0;
+  byte _num_active_sends = 0, _send_budget = 1;
+  unsigned int _send_pool_len = 0;
+  void (*_sendcompletehandler)(const void *msg, unsigned int msg_len, byte stream_id) = NULL;
+  byte *_context_storage = NULL;                // the single block holding every context, buffer and hot field array
+  receive_context_t *_receive_context = NULL;
+  send_context_t *_send_context = NULL;
+  bool *_rx_in_use = NULL, *_tx_in_use = NULL;
+  byte *_rx_stream_id = NULL, *_rx_canid = NULL, *_tx_stream_id = NULL;
+  byte *_tx_active = NULL;                      // indexes of the send contexts in use, in the order they were started
+  byte *_rx_bucket = NULL;                      // receive demultiplexer: first context in each (CANID, stream ID) hash bucket, or 0xff
+  byte *_rx_next = NULL;                        // next context in the same bucket, or 0xff
+  byte *_rx_free = NULL;                        // stack of free receive contexts
+  byte _rx_hash_mask = 0, _rx_free_count = 0;
+  byte _subscribed[32] = {};                    // 256 bits, one per subscribed stream ID
+  byte *_send_pool = NULL;                      // reserved copy buffers, one slot of _send_pool_len bytes per send context
 };
 
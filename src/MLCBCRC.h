@@ -0,0 +1,101 @@
+
+/*
+  Copyright (C) Duncan Greenwood 2023 (duncan_greenwood@hotmail.com)
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                  and indicate if changes were made. You may do so in any reasonable manner,
+                  but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                 your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                 legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+//
+/// CRC-16 and CRC-32 for multipart messages
+/// CRC-16 is the reflected CCITT polynomial (0x8408) carried in the RFC 0005 header packet,
+/// CRC-32 is the IEEE 802.3 polynomial (0xEDB88320)
+/// both are table-driven: a 16-entry nibble table on AVR, where flash and RAM are scarce, and a 256-entry byte table elsewhere
+/// the bitwise, nibble and byte table routines are all available, so they can be checked and benchmarked against one another
+/// define MLCB_CRC_NIBBLE_TABLE to use the nibble table on other architectures
+//
+
+#pragma once
+
+#include <Arduino.h>      // for definition of byte datatype
+
+#if defined(__AVR__) && !defined(MLCB_CRC_NIBBLE_TABLE)
+#define MLCB_CRC_NIBBLE_TABLE
+#endif
+
+// raw update routines, which carry the register between calls without the final inversion
+
+uint16_t crc16_update_bitwise(uint16_t crc, const byte *data, unsigned int len);
+uint16_t crc16_update_nibble(uint16_t crc, const byte *data, unsigned int len);
+uint16_t crc16_update_byte(uint16_t crc, const byte *data, unsigned int len);
+
+uint32_t crc32_update_bitwise(uint32_t crc, const byte *data, unsigned int len);
+uint32_t crc32_update_nibble(uint32_t crc, const byte *data, unsigned int len);
+uint32_t crc32_update_byte(uint32_t crc, const byte *data, unsigned int len);
+
+// one-shot functions
+
+uint16_t crc16(const byte *data, unsigned int len);
+uint32_t crc32(const byte *data, unsigned int len);
+
+//
+/// streaming CRC-16, which may be fed a message piece by piece as it arrives
+/// value() returns the CRC in the byte order sent in the header packet
+//
+
+class MLCBCRC16 {
+
+public:
+  MLCBCRC16() { reset(); }
+  void reset(void) { _crc = 0xffff; }
+  void update(const void *data, unsigned int len);
+  uint16_t value(void) const;
+
+private:
+  uint16_t _crc;
+};
+
+//
+/// streaming CRC-32
+//
+
+class MLCBCRC32 {
+
+public:
+  MLCBCRC32() { reset(); }
+  void reset(void) { _crc = 0xffffffff; }
+  void update(const void *data, unsigned int len);
+  uint32_t value(void) const { return ~_crc; }
+
+private:
+  uint32_t _crc;
+};
@@ -59,14 +59,23 @@ extern "C" char* sbrk(int incr);
 
 // #ifdef __AVR_XMEGA__
 #if defined(DXCORE)
-flash_page_t cache_page;                // flash page cache
-byte curr_page_num = 0;
+flash_page_t cache_pages[FLASH_CACHE_PAGES];    // flash page cache
+unsigned long flash_cache_clock = 0;            // incremented on each cache access, for LRU replacement
+unsigned long flash_last_write = 0;             // millis() of the last write into the cache
 #endif
 
 #ifdef __SAM3X8E__
 DueFlashStorage dueFlashStorage;
 #endif
 
+//
+/// hash values are 1 - 127 and 255, so 255 is counted in the otherwise unused bucket 0
+//
+
+static inline byte hashBucket(byte hash) {
+  return (hash >= HASH_LENGTH) ? 0 : hash;
+}
+
 //
 /// ctor
 //
@@ -74,6 +83,47 @@ DueFlashStorage dueFlashStorage;
 MLCBConfig::MLCBConfig() {
   eeprom_type = EEPROM_INTERNAL;
   I2Cbus = &Wire;
+  ext_page_size = EE_EXT_DEFAULT_PAGE_SIZE;
+  ext_write_pending = false;
+  evhashtbl = NULL;
+  evhashcounts = NULL;
+  evhashhead = NULL;
+  evhashnext = NULL;
+  evfreemap = NULL;
+  evused = 0;
+  use_event_index = false;
+  evkeytbl = NULL;
+  evkeyidx = NULL;
+  evkeycount = 0;
+  short_idx_size = 0;
+  short_en = NULL;
+  short_slot = NULL;
+  evcache_width = 0;
+  evcache = NULL;
+  use_shadow = false;
+  shadow = NULL;
+  shadow_dirty = NULL;
+  shadow_len = 0;
+  shadow_num_dirty = 0;
+  shadow_last_write = 0;
+  ee_bytes_requested = 0;
+  ee_bytes_written = 0;
+  ee_device_writes = 0;
+  ee_transaction_depth = 0;
+  ee_commit_pending = false;
+  ee_commits = 0;
+  boot_micros = 0;
+  evtable_load_micros = 0;
+  nvlog_start = 0;
+  nvlog_len = 0;
+  nvlog_next = 0;
+  nvlog_bank = 0;
+  nvlog_seq = 0;
+  nvlog_num_keys = 0;
+  nvlog_values = NULL;
+  nvlog_present = NULL;
+  nvlog_appends = 0;
+  nvlog_compactions = 0;
 }
 
 //
@@ -82,6 +132,8 @@ MLCBConfig::MLCBConfig() {
 
 void MLCBConfig::begin(void) {
 
+  unsigned long start = micros();
+
   EE_BYTES_PER_EVENT = EE_NUM_EVS + 4;
 
   if (eeprom_type == EEPROM_INTERNAL) {
@@ -116,8 +168,130 @@ void MLCBConfig::begin(void) {
 #endif
   }
 
+  if (use_shadow) {
+    loadShadow();
+  }
+
   makeEvHashTable();
   loadNVs();
+
+  boot_micros = micros() - start;
+}
+
+//
+/// enable the write-back RAM shadow, which must be called before begin()
+/// the shadow holds the node identity, NVs and events in RAM; reads are served from it and writes are
+/// coalesced into dirty blocks, which are written to the device from process() or by flush()
+//
+
+void MLCBConfig::setShadow(bool use) {
+
+  use_shadow = use;
+}
+
+//
+/// allocate the shadow and fill it from the device
+//
+
+void MLCBConfig::loadShadow(void) {
+
+  unsigned int len = EE_EVENTS_START + (EE_MAX_EVENTS * EE_BYTES_PER_EVENT);
+  unsigned int num_blocks;
+  byte *buf;
+
+  if (shadow != NULL) {
+    return;
+  }
+
+  if (EE_NVS_START + EE_NUM_NVS > len) {
+    len = EE_NVS_START + EE_NUM_NVS;
+  }
+
+  num_blocks = (len + EE_SHADOW_BLOCK_SIZE - 1) / EE_SHADOW_BLOCK_SIZE;
+
+  if ((buf = (byte *)malloc(len)) == NULL) {
+    return;
+  }
+
+  if ((shadow_dirty = (byte *)calloc((num_blocks + 7) / 8, 1)) == NULL) {
+    free(buf);
+    return;
+  }
+
+  // read in block-sized chunks, which fit the I2C buffer
+  for (unsigned int addr = 0; addr < len; addr += EE_SHADOW_BLOCK_SIZE) {
+    readBytesEEPROM(addr, (len - addr < EE_SHADOW_BLOCK_SIZE) ? len - addr : EE_SHADOW_BLOCK_SIZE, &buf[addr]);
+  }
+
+  shadow = buf;
+  shadow_len = len;
+  shadow_num_dirty = 0;
+}
+
+//
+/// write one dirty shadow block to the device
+/// returns false if there was nothing to write
+//
+
+bool MLCBConfig::flushBlock(void) {
+
+  unsigned int num_blocks = (shadow_len + EE_SHADOW_BLOCK_SIZE - 1) / EE_SHADOW_BLOCK_SIZE;
+
+  if (shadow_num_dirty == 0) {
+    return false;
+  }
+
+  for (unsigned int block = 0; block < num_blocks; block++) {
+    if (shadow_dirty[block / 8] & (1 << (block % 8))) {
+      unsigned int addr = block * EE_SHADOW_BLOCK_SIZE;
+      byte len = (shadow_len - addr < EE_SHADOW_BLOCK_SIZE) ? shadow_len - addr : EE_SHADOW_BLOCK_SIZE;
+
+      shadow_dirty[block / 8] &= ~(1 << (block % 8));
+      --shadow_num_dirty;
+      writeDeviceBytes(addr, &shadow[addr], len);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//
+/// write all dirty shadow blocks to the device, and any dirty pages of the flash cache
+//
+
+void MLCBConfig::flush(void) {
+
+  while (flushBlock()) {
+    ;
+  }
+
+// #ifdef __AVR_XMEGA__
+#if defined(DXCORE)
+  if (eeprom_type == EEPROM_USES_FLASH) {
+    flash_flush();
+  }
+#endif
+}
+
+//
+/// idle processing, called from MLCBbase::process()
+/// once writes have stopped for a while, flush one dirty block per call so that no single call blocks for long
+//
+
+void MLCBConfig::process(void) {
+
+  if (shadow_num_dirty > 0 && millis() - shadow_last_write >= EE_SHADOW_FLUSH_DELAY) {
+    flushBlock();
+  }
+
+// #ifdef __AVR_XMEGA__
+#if defined(DXCORE)
+  // likewise, write back one dirty flash page per call
+  if (eeprom_type == EEPROM_USES_FLASH && millis() - flash_last_write >= EE_SHADOW_FLUSH_DELAY) {
+    flash_flush_page();
+  }
+#endif
 }
 
 //
@@ -173,6 +347,48 @@ void MLCBConfig::setExtEEPROMAddress(byte address, TwoWire *bus) {
   I2Cbus = bus;
 }
 
+//
+/// set the page size of an external EEPROM chip -- writes are split so that none crosses a page boundary
+/// returns false, leaving the page size unchanged, if the size is zero
+//
+
+bool MLCBConfig::setExtEEPROMPageSize(unsigned int page_size) {
+
+  if (page_size == 0) {
+    return false;
+  }
+
+  ext_page_size = page_size;
+  return true;
+}
+
+//
+/// wait for the external EEPROM to complete its internal write cycle
+/// the chip does not acknowledge its address until the cycle is complete, so we poll rather than sleep
+/// for the worst case; returns false on timeout
+//
+
+bool MLCBConfig::waitForExtEEPROM(void) {
+
+  unsigned long start = millis();
+
+  if (!ext_write_pending) {
+    return true;
+  }
+
+  do {
+    I2Cbus->beginTransmission(external_address);
+
+    if (I2Cbus->endTransmission() == 0) {
+      ext_write_pending = false;
+      return true;
+    }
+  } while (millis() - start <= EE_EXT_WRITE_TIMEOUT);
+
+  ext_write_pending = false;
+  return false;
+}
+
 //
 /// store the FLiM mode
 //
@@ -202,23 +418,62 @@ void MLCBConfig::setCANID(byte canid) {
 void MLCBConfig::setNodeNum(unsigned int nn) {
 
   nodeNum = nn;
+  beginTransaction();
   writeEEPROM(2, highByte(nodeNum));
   writeEEPROM(3, lowByte(nodeNum));
+  commit();
   return;
 }
 
 //
-/// lookup an event by node number and event number, using the hash table
+/// enable the full-key event index, which must be called before begin()
+/// the index holds the full NN + EN of every stored event in RAM, (5 x EE_MAX_EVENTS bytes),
+/// so that lookups are exact and need no EEPROM reads
+//
+
+void MLCBConfig::setEventIndex(bool use_index) {
+
+  use_event_index = use_index;
+}
+
+//
+/// keep a RAM copy of the first num_evs EVs of each event, which must be called before begin()
+/// EV reads for event dispatch and REVAL are then served from RAM; the cache costs EE_MAX_EVENTS x num_evs bytes
+//
+
+void MLCBConfig::setEVCache(byte num_evs) {
+
+  evcache_width = num_evs;
+}
+
+//
+/// lookup an event by node number and event number, using the full-key index or the chains of the hash table
 //
 
 byte MLCBConfig::findExistingEvent(unsigned int nn, unsigned int en) {
 
   byte tarray[4];
-  byte tmphash, i, j, matches;
-  bool confirmed = false;
+  byte tmphash, i;
 
   // DEBUG_SERIAL << F("> looking for match with ") << nn << ", " << en << endl;
 
+  // short events are looked up by device number alone, with a single probe of the short event index
+  if (nn == 0 && short_slot != NULL) {
+    byte s = en & (short_idx_size - 1);
+
+    if (short_slot[s] == SHORT_IDX_EMPTY || (short_slot[s] != SHORT_IDX_SHARED && short_en[s] != en)) {
+      return EE_MAX_EVENTS;
+    } else if (short_slot[s] != SHORT_IDX_SHARED) {
+      return short_slot[s];
+    }
+
+    // more than one short event maps to this slot, so use the general lookup
+  }
+
+  if (evkeytbl != NULL) {
+    return findEventKey(((uint32_t)nn << 16) | en);
+  }
+
   tarray[0] = highByte(nn);
   tarray[1] = lowByte(nn);
   tarray[2] = highByte(en);
@@ -228,80 +483,185 @@ byte MLCBConfig::findExistingEvent(unsigned int nn, unsigned int en) {
   tmphash = makeHash(tarray);
   // DEBUG_SERIAL << F("> event hash = ") << tmphash << endl;
 
-  for (i = 0; i < EE_MAX_EVENTS; i++) {
+  // only the slots chained under this hash are candidates, and each is checked against the stored NN and EN,
+  // so a hash shared with another event, or one we haven't seen before, is never mistaken for a match
+  for (i = evhashhead[hashBucket(tmphash)]; i != EV_CHAIN_END; i = evhashnext[i]) {
+    readEvent(i, tarray);
+    if ((unsigned int)((tarray[0] << 8) + tarray[1]) == nn && (unsigned int)((tarray[2] << 8) + tarray[3]) == en) {
+      return i;
+    }
+  }
 
-    if (evhashtbl[i] == tmphash) {
-      if (!hash_collision) {
-        // NN + EN hash matches and there are no hash collisions in the hash table
-      } else {
-        // there is a potential hash collision, so we have to check the slower way
-        // first, check if this hash appears in the table more than once
+  // DEBUG_SERIAL << F("> unable to find matching event") << endl;
+  return EE_MAX_EVENTS;
+}
 
-        // DEBUG_SERIAL << F("> there are hash collisions") << endl;
+//
+/// binary search of the full-key index
+/// returns the event table index, or EE_MAX_EVENTS if the event is not stored
+//
 
-        for (j = 0, matches = 0; j < EE_MAX_EVENTS; j++) {
-          if (evhashtbl[j] == tmphash) {
-            ++matches;
-          }
-        }
+byte MLCBConfig::findEventKey(uint32_t key) {
 
-        if (matches > 1) {
-          // one or more collisions for this hash exist, so check the very slow way
-          // DEBUG_SERIAL << F("> this hash matches = ") << matches << endl;
-
-          for (i = 0; i < EE_MAX_EVENTS; i++) {
-            if (evhashtbl[i] == tmphash) {
-              // check the EEPROM for a match with the incoming NN and EN
-              readEvent(i, tarray);
-              if ((unsigned int)((tarray[0] << 8) + tarray[1]) == nn && (unsigned int)((tarray[2] << 8) + tarray[3]) == en) {
-                // the stored NN and EN match this event, so no further checking is required
-                confirmed = true;
-                break;
-              }
-            }
-          }
-        } else {
-          // no collisions for this specific hash, so no further checking is required
-          break;
-        }
-      }
+  byte lo = 0, hi = evkeycount;
 
-      break;
+  while (lo < hi) {
+    byte mid = lo + ((hi - lo) >> 1);
+
+    if (evkeytbl[mid] < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
 
-  // finally, there may be a collision with an event that we haven't seen before
-  // so we still need to check the candidate match to be certain, if we haven't done so already
+  if (lo < evkeycount && evkeytbl[lo] == key) {
+    return evkeyidx[lo];
+  }
+
+  return EE_MAX_EVENTS;
+}
 
-  if (i < EE_MAX_EVENTS && !confirmed) {
-    readEvent(i, tarray);
-    if (!((unsigned int)((tarray[0] << 8) + tarray[1]) == nn && (unsigned int)((tarray[2] << 8) + tarray[3]) == en)) {
-      // the stored NN and EN do not match this event
-      // DEBUG_SERIAL << F("> hash result does not match stored event") << endl;
-      i = EE_MAX_EVENTS;
+//
+/// add a stored event to the full-key index, keeping the keys in order
+//
+
+void MLCBConfig::indexEvent(byte idx, byte tarr[]) {
+
+  uint32_t key = ((uint32_t)tarr[0] << 24) | ((uint32_t)tarr[1] << 16) | ((uint32_t)tarr[2] << 8) | tarr[3];
+  byte pos = evkeycount;
+
+  if (evkeytbl == NULL || evkeycount >= EE_MAX_EVENTS) {
+    return;
+  }
+
+  while (pos > 0 && evkeytbl[pos - 1] > key) {
+    evkeytbl[pos] = evkeytbl[pos - 1];
+    evkeyidx[pos] = evkeyidx[pos - 1];
+    --pos;
+  }
+
+  evkeytbl[pos] = key;
+  evkeyidx[pos] = idx;
+  ++evkeycount;
+}
+
+//
+/// remove an event table slot from the full-key index, if present
+//
+
+void MLCBConfig::unindexEvent(byte idx) {
+
+  byte pos;
+
+  if (evkeytbl == NULL) {
+    return;
+  }
+
+  for (pos = 0; pos < evkeycount; pos++) {
+    if (evkeyidx[pos] == idx) {
+      break;
     }
   }
 
-  // if (i >= EE_MAX_EVENTS) DEBUG_SERIAL << F("> unable to find matching event") << endl;
-  return i;
+  if (pos >= evkeycount) {
+    return;
+  }
+
+  --evkeycount;
+  memmove(&evkeytbl[pos], &evkeytbl[pos + 1], (evkeycount - pos) * sizeof(uint32_t));
+  memmove(&evkeyidx[pos], &evkeyidx[pos + 1], (evkeycount - pos) * sizeof(byte));
+}
+
+//
+/// enable the direct-mapped short event index, which must be called before begin()
+/// short events (NN = 0) are indexed by the low bits of their device number, so ASON/ASOF lookups take a single probe
+/// size is the number of slots, a power of two up to 128, costing 3 bytes each
+/// slots shared by more than one short event fall back to the general lookup until the table is next rebuilt
+//
+
+bool MLCBConfig::setShortEventIndex(byte size) {
+
+  if (size == 0 || size > 128 || (size & (size - 1)) != 0) {
+    return false;
+  }
+
+  short_idx_size = size;
+  return true;
+}
+
+//
+/// empty the short event index
+//
+
+void MLCBConfig::resetShortEventIndex(void) {
+
+  if (short_slot != NULL) {
+    memset(short_slot, SHORT_IDX_EMPTY, short_idx_size);
+  }
 }
 
 //
-/// find the first empty EEPROM event slot - the hash table entry == 0
+/// add a stored event to the short event index, if it is a short event
+//
+
+void MLCBConfig::indexShortEvent(byte idx, byte tarr[]) {
+
+  if (short_slot == NULL || tarr[0] != 0 || tarr[1] != 0) {
+    return;
+  }
+
+  uint16_t en = (tarr[2] << 8) + tarr[3];
+  byte s = en & (short_idx_size - 1);
+
+  // indexes that coincide with the marker values are left to the general lookup
+  if (short_slot[s] == SHORT_IDX_EMPTY && idx < SHORT_IDX_SHARED) {
+    short_slot[s] = idx;
+    short_en[s] = en;
+  } else if (short_slot[s] != idx) {
+    short_slot[s] = SHORT_IDX_SHARED;
+  }
+}
+
+//
+/// remove an event table slot from the short event index, if present
+/// a shared slot stays shared, as the other events that map to it are not known
+//
+
+void MLCBConfig::unindexShortEvent(byte idx) {
+
+  // indexes that coincide with the marker values are never held in a slot
+  if (short_slot == NULL || idx >= SHORT_IDX_SHARED) {
+    return;
+  }
+
+  for (byte s = 0; s < short_idx_size; s++) {
+    if (short_slot[s] == idx) {
+      short_slot[s] = SHORT_IDX_EMPTY;
+      return;
+    }
+  }
+}
+
+//
+/// find the first empty EEPROM event slot, using the free slot bitmap
+/// returns EE_MAX_EVENTS if the table is full
 //
 
 byte MLCBConfig::findEventSpace(void) {
 
-  byte evidx;
+  if (evused >= EE_MAX_EVENTS) {
+    return EE_MAX_EVENTS;
+  }
 
-  for (evidx = 0; evidx < EE_MAX_EVENTS; evidx++) {
-    if (evhashtbl[evidx] == 0)  {
-      // DEBUG_SERIAL << F("> found unused location at index = ") << evidx << endl;
-      break;
+  for (byte i = 0; i < (EE_MAX_EVENTS + 7) / 8; i++) {
+    if (evfreemap[i] != 0) {
+      // DEBUG_SERIAL << F("> found unused location at index = ") << (i * 8) + __builtin_ctz(evfreemap[i]) << endl;
+      return (i * 8) + __builtin_ctz(evfreemap[i]);
     }
   }
 
-  return evidx;
+  return EE_MAX_EVENTS;
 }
 
 //
@@ -351,45 +711,153 @@ void MLCBConfig::readEvent(byte idx, byte tarr[]) {
 
 byte MLCBConfig::getEventEVval(byte idx, byte evnum) {
 
+  if (evnum >= 1 && evnum <= evcache_width && evcache != NULL) {
+    return evcache[(idx * evcache_width) + evnum - 1];
+  }
+
   return readEEPROM(EE_EVENTS_START + (idx * EE_BYTES_PER_EVENT) + 3 + evnum);
 }
 
+//
+/// return all EE_NUM_EVS event variables of an event
+/// if they are all in the EV cache, a pointer into the cache is returned; otherwise they are read
+/// with a single bulk read into buf, which must hold EE_NUM_EVS bytes
+/// returns NULL if the EEPROM did not return them all
+//
+
+const byte *MLCBConfig::getEventEVs(byte idx, byte buf[]) {
+
+  if (evcache != NULL && evcache_width == EE_NUM_EVS) {
+    return &evcache[idx * evcache_width];
+  }
+
+  if (readBytesEEPROM(EE_EVENTS_START + (idx * EE_BYTES_PER_EVENT) + EE_HASH_BYTES, EE_NUM_EVS, buf) < EE_NUM_EVS) {
+    return NULL;
+  }
+
+  return buf;
+}
+
 //
 /// write an event variable
 //
 
 void MLCBConfig::writeEventEV(byte idx, byte evnum, byte evval) {
 
+  if (evnum >= 1 && evnum <= evcache_width && evcache != NULL) {
+    evcache[(idx * evcache_width) + evnum - 1] = evval;
+  }
+
   writeEEPROM(EE_EVENTS_START + (idx * EE_BYTES_PER_EVENT) + 3 + evnum, evval);
 }
 
 //
 /// re/create the event hash table
+/// the event table is streamed from EEPROM in bursts of whole events, as large as the I2C buffer allows
 //
 
 void MLCBConfig::makeEvHashTable(void) {
 
-  byte evarray[4];
+  byte buf[EE_EXT_MAX_READ];
   const byte unused_entry[4] = { 0xff, 0xff, 0xff, 0xff};
+  byte events_per_burst, burst_len;
+  unsigned long start = micros();
 
   // DEBUG_SERIAL << F("> creating event hash table") << endl;
 
-  evhashtbl = (byte *)malloc(EE_MAX_EVENTS * sizeof(byte));
+  if (evhashtbl == NULL) {
+    evhashtbl = (byte *)malloc(EE_MAX_EVENTS * sizeof(byte));
+    evhashcounts = (byte *)malloc(HASH_LENGTH * sizeof(byte));
+    evhashhead = (byte *)malloc(HASH_LENGTH * sizeof(byte));
+    evhashnext = (byte *)malloc(EE_MAX_EVENTS * sizeof(byte));
+    evfreemap = (byte *)malloc((EE_MAX_EVENTS + 7) / 8);
+  }
+
+  memset(evhashtbl, 0, EE_MAX_EVENTS * sizeof(byte));
+  memset(evhashcounts, 0, HASH_LENGTH * sizeof(byte));
+  memset(evhashhead, EV_CHAIN_END, HASH_LENGTH * sizeof(byte));
+  hash_collisions = 0;
+  resetFreeMap();
+
+  // the optional full-key index is sized for a full event table
+  if (use_event_index && evkeytbl == NULL) {
+    evkeytbl = (uint32_t *)malloc(EE_MAX_EVENTS * sizeof(uint32_t));
+    evkeyidx = (byte *)malloc(EE_MAX_EVENTS * sizeof(byte));
+
+    if (evkeytbl == NULL || evkeyidx == NULL) {
+      free(evkeytbl);
+      free(evkeyidx);
+      evkeytbl = NULL;
+      evkeyidx = NULL;
+    }
+  }
 
-  for (byte idx = 0; idx < EE_MAX_EVENTS; idx++) {
+  evkeycount = 0;
 
-    readEvent(idx, evarray);
+  // the optional short event index
+  if (short_idx_size > 0 && short_slot == NULL) {
+    short_en = (uint16_t *)malloc(short_idx_size * sizeof(uint16_t));
+    short_slot = (byte *)malloc(short_idx_size);
 
-    // empty slots have all four bytes set to 0xff
-    if (memcmp(evarray, unused_entry, 4) == 0) {
-      evhashtbl[idx] = 0;
-    } else {
-      evhashtbl[idx] = makeHash(evarray);
+    if (short_en == NULL || short_slot == NULL) {
+      free(short_en);
+      free(short_slot);
+      short_en = NULL;
+      short_slot = NULL;
     }
   }
 
-  hash_collision = check_hash_collisions();
+  resetShortEventIndex();
+
+  // the optional EV cache, limited to the EVs each event actually has
+  if (evcache_width > EE_NUM_EVS) {
+    evcache_width = EE_NUM_EVS;
+  }
+
+  if (evcache_width > 0 && evcache == NULL) {
+    if ((evcache = (byte *)malloc(EE_MAX_EVENTS * evcache_width)) == NULL) {
+      evcache_width = 0;
+    }
+  }
+
+  // events too large for a single burst are read as just their four key bytes
+  if (EE_BYTES_PER_EVENT <= EE_EXT_MAX_READ) {
+    events_per_burst = EE_EXT_MAX_READ / EE_BYTES_PER_EVENT;
+    burst_len = events_per_burst * EE_BYTES_PER_EVENT;
+  } else {
+    events_per_burst = 1;
+    burst_len = EE_HASH_BYTES;
+  }
 
+  for (unsigned int first = 0; first < EE_MAX_EVENTS; first += events_per_burst) {
+    byte num_events = (EE_MAX_EVENTS - first < events_per_burst) ? EE_MAX_EVENTS - first : events_per_burst;
+
+    readBytesEEPROM(EE_EVENTS_START + (first * EE_BYTES_PER_EVENT), (num_events == events_per_burst) ? burst_len : num_events * EE_BYTES_PER_EVENT, buf);
+
+    for (byte i = 0; i < num_events; i++) {
+      byte *evarray = &buf[i * EE_BYTES_PER_EVENT];
+
+      // empty slots have all four bytes set to 0xff
+      if (memcmp(evarray, unused_entry, 4) != 0) {
+        setEvHashEntry(first + i, makeHash(evarray));
+        indexEvent(first + i, evarray);
+        indexShortEvent(first + i, evarray);
+      }
+
+      // EVs follow the four key bytes, and are cached for empty slots too, as EVLRN may write EVs before the event
+      if (evcache_width > 0) {
+        byte *evs = &evcache[(first + i) * evcache_width];
+
+        if (burst_len == EE_HASH_BYTES) {
+          readBytesEEPROM(EE_EVENTS_START + ((first + i) * EE_BYTES_PER_EVENT) + EE_HASH_BYTES, evcache_width, evs);
+        } else {
+          memcpy(evs, &evarray[EE_HASH_BYTES], evcache_width);
+        }
+      }
+    }
+  }
+
+  evtable_load_micros = micros() - start;
   return;
 }
 
@@ -404,20 +872,83 @@ void MLCBConfig::updateEvHashEntry(byte idx) {
 
   // read the first four bytes from EEPROM - NN + EN
   readEvent(idx, evarray);
+  unindexEvent(idx);
+  unindexShortEvent(idx);
 
   // empty slots have all four bytes set to 0xff
   if (memcmp(evarray, unused_entry, 4) == 0) {
-    evhashtbl[idx] = 0;
+    setEvHashEntry(idx, 0);
   } else {
-    evhashtbl[idx] = makeHash(evarray);
+    setEvHashEntry(idx, makeHash(evarray));
+    indexEvent(idx, evarray);
+    indexShortEvent(idx, evarray);
   }
 
-  hash_collision = check_hash_collisions();
-
   // DEBUG_SERIAL << F("> updateEvHashEntry for idx = ") << idx << F(", hash = ") << hash << endl;
   return;
 }
 
+//
+/// mark every event table slot as free
+//
+
+void MLCBConfig::resetFreeMap(void) {
+
+  memset(evfreemap, 0xff, (EE_MAX_EVENTS + 7) / 8);
+
+  // bits beyond the end of the table are never free
+  if (EE_MAX_EVENTS % 8) {
+    evfreemap[EE_MAX_EVENTS / 8] = (1 << (EE_MAX_EVENTS % 8)) - 1;
+  }
+
+  evused = 0;
+}
+
+//
+/// set a single hash table entry, 0 for an empty slot, and maintain the per-hash occupancy counts and slot chains
+//
+
+void MLCBConfig::setEvHashEntry(byte idx, byte hash) {
+
+  byte old = evhashtbl[idx];
+
+  if (old != 0) {
+    byte *link = &evhashhead[hashBucket(old)];
+
+    // unlink the slot from the chain for its old hash
+    while (*link != idx) {
+      link = &evhashnext[*link];
+    }
+
+    *link = evhashnext[idx];
+
+    if (--evhashcounts[hashBucket(old)] == 1) {
+      --hash_collisions;
+    }
+  }
+
+  if (hash != 0) {
+    evhashnext[idx] = evhashhead[hashBucket(hash)];
+    evhashhead[hashBucket(hash)] = idx;
+
+    if (++evhashcounts[hashBucket(hash)] == 2) {
+      ++hash_collisions;
+    }
+  }
+
+  // maintain the free slot bitmap and used count
+  if (old == 0 && hash != 0) {
+    evfreemap[idx / 8] &= ~(1 << (idx % 8));
+    ++evused;
+  } else if (old != 0 && hash == 0) {
+    evfreemap[idx / 8] |= (1 << (idx % 8));
+    --evused;
+  }
+
+  evhashtbl[idx] = hash;
+  hash_collision = (hash_collisions > 0);
+}
+
 //
 /// clear the hash table
 //
@@ -431,7 +962,13 @@ void MLCBConfig::clearEvHashTable(void) {
     evhashtbl[i] = 0;
   }
 
+  memset(evhashcounts, 0, HASH_LENGTH * sizeof(byte));
+  memset(evhashhead, EV_CHAIN_END, HASH_LENGTH * sizeof(byte));
+  hash_collisions = 0;
   hash_collision = false;
+  evkeycount = 0;
+  resetFreeMap();
+  resetShortEventIndex();
   return;
 }
 
@@ -469,15 +1006,16 @@ void MLCBConfig::printEvHashTable(bool raw) {
 
 byte MLCBConfig::numEvents(void) {
 
-  byte numevents = 0;
+  return evused;
+}
 
-  for (byte i = 0; i < EE_MAX_EVENTS; i++) {
-    if (evhashtbl[i] != 0) {
-      ++numevents;
-    }
-  }
+//
+/// return the number of free event slots
+//
 
-  return numevents;
+byte MLCBConfig::numFreeEvents(void) {
+
+  return EE_MAX_EVENTS - evused;
 }
 
 //
@@ -529,10 +1067,24 @@ byte MLCBConfig::readEEPROM(unsigned int eeaddress) {
 
   // DEBUG_SERIAL << F("> readEEPROM, addr = ") << eeaddress << endl;
 
+  // identity and NVs are served from the log index, once they have been written there
+  if (nvlog_values != NULL) {
+    byte key = NVLogKey(eeaddress);
+
+    if (key != 0xff && (nvlog_present[key / 8] & (1 << (key % 8)))) {
+      return nvlog_values[key];
+    }
+  }
+
+  if (eeaddress < shadow_len) {
+    return shadow[eeaddress];
+  }
+
   switch (eeprom_type) {
 
   case EEPROM_EXTERNAL:
 
+    waitForExtEEPROM();
     I2Cbus->beginTransmission(external_address);
     I2Cbus->write((int)(eeaddress >> 8));    // MSB
     I2Cbus->write((int)(eeaddress & 0xFF));  // LSB
@@ -554,7 +1106,7 @@ byte MLCBConfig::readEEPROM(unsigned int eeaddress) {
   case EEPROM_USES_FLASH:
 // #ifdef __AVR_XMEGA__
 #if defined(DXCORE)
-    rdata = Flash.readByte(FLASH_AREA_BASE_ADDRESS + eeaddress);
+    rdata = flash_read_byte(eeaddress);
     // DEBUG_SERIAL << F("> read byte = ") << rdata << F(" from address = ") << eeaddress << endl;
 #endif
     break;
@@ -573,22 +1125,48 @@ byte MLCBConfig::readBytesEEPROM(unsigned int eeaddress, byte nbytes, byte dest[
   int r = 0;
   byte count = 0;
 
+  if (eeaddress + nbytes <= shadow_len) {
+    memcpy(dest, &shadow[eeaddress], nbytes);
+    return nbytes;
+  } else if (eeaddress < shadow_len) {
+    for (count = 0; count < nbytes; count++) {
+      dest[count] = readEEPROM(eeaddress + count);
+    }
+
+    return count;
+  }
+
   switch (eeprom_type) {
 
   case EEPROM_EXTERNAL:
-    I2Cbus->beginTransmission(external_address);
-    I2Cbus->write((int)(eeaddress >> 8));    // MSB
-    I2Cbus->write((int)(eeaddress & 0xFF));  // LSB
-    r = I2Cbus->endTransmission();
+    waitForExtEEPROM();
 
-    if (r < 0) {
-      // DEBUG_SERIAL << F("> readBytesEEPROM: I2C write error = ") << r << endl;
-    }
+    // the Wire buffer limits each read, so longer reads are made in chunks
+    while (count < nbytes) {
+      byte chunk = (nbytes - count > EE_EXT_MAX_READ) ? EE_EXT_MAX_READ : nbytes - count;
+      byte got = 0;
+
+      I2Cbus->beginTransmission(external_address);
+      I2Cbus->write((int)((eeaddress + count) >> 8));    // MSB
+      I2Cbus->write((int)((eeaddress + count) & 0xFF));  // LSB
+      r = I2Cbus->endTransmission();
+
+      if (r != 0) {
+        // DEBUG_SERIAL << F("> readBytesEEPROM: I2C write error = ") << r << endl;
+        break;
+      }
 
-    I2Cbus->requestFrom((int)external_address, (int)nbytes);
+      I2Cbus->requestFrom((int)external_address, (int)chunk);
 
-    while (I2Cbus->available() && count < nbytes) {
-      dest[count++] = I2Cbus->read();
+      while (I2Cbus->available() && got < chunk) {
+        dest[count++] = I2Cbus->read();
+        ++got;
+      }
+
+      // a short read means the device did not respond in full, so stop and report what was read
+      if (got < chunk) {
+        break;
+      }
     }
 
     // DEBUG_SERIAL << F("> readBytesEEPROM: read ") << count << F(" bytes from EEPROM in ") << micros() - t1 << F("us") << endl;
@@ -603,9 +1181,8 @@ byte MLCBConfig::readBytesEEPROM(unsigned int eeaddress, byte nbytes, byte dest[
   case EEPROM_USES_FLASH:
 // #ifdef __AVR_XMEGA__
 #if defined(DXCORE)
-    for (count = 0; count < nbytes; count++) {
-      dest[count] = Flash.readByte(FLASH_AREA_BASE_ADDRESS + eeaddress + count);
-    }
+    flash_read_bytes(eeaddress, nbytes, dest);
+    count = nbytes;
 #endif
     break;
   }
@@ -623,15 +1200,51 @@ void MLCBConfig::writeEEPROM(unsigned int eeaddress, byte data) {
 
   // DEBUG_SERIAL << F("> writeEEPROM, addr = ") << eeaddress << F(", data = ") << data << endl;
 
+  ++ee_bytes_requested;
+
+  // identity and NVs are appended to the log rather than rewritten in place
+  if (nvlog_values != NULL) {
+    byte key = NVLogKey(eeaddress);
+
+    if (key != 0xff) {
+      if (!(nvlog_present[key / 8] & (1 << (key % 8))) || nvlog_values[key] != data) {
+        appendNVLog(key, data);
+      }
+
+      return;
+    }
+  }
+
+  if (eeaddress < shadow_len) {
+    if (shadow[eeaddress] != data) {
+      unsigned int block = eeaddress / EE_SHADOW_BLOCK_SIZE;
+
+      shadow[eeaddress] = data;
+
+      if (!(shadow_dirty[block / 8] & (1 << (block % 8)))) {
+        shadow_dirty[block / 8] |= (1 << (block % 8));
+        ++shadow_num_dirty;
+      }
+    }
+
+    shadow_last_write = millis();
+    return;
+  }
+
+  ++ee_device_writes;
+  ++ee_bytes_written;
+
   switch (eeprom_type) {
 
   case EEPROM_EXTERNAL:
+    // the write cycle completes in the background; the next access polls for it
+    waitForExtEEPROM();
     I2Cbus->beginTransmission(external_address);
     I2Cbus->write((int)(eeaddress >> 8)); // MSB
     I2Cbus->write((int)(eeaddress & 0xFF)); // LSB
     I2Cbus->write(data);
     r = I2Cbus->endTransmission();
-    delay(5);
+    ext_write_pending = true;
 
     if (r < 0) {
       // DEBUG_SERIAL << F("> writeEEPROM: I2C write error = ") << r << endl;
@@ -660,36 +1273,78 @@ void MLCBConfig::writeEEPROM(unsigned int eeaddress, byte data) {
 
 void MLCBConfig::writeBytesEEPROM(unsigned int eeaddress, byte src[], byte numbytes) {
 
-  // *** TODO *** handle greater than 32 bytes -> the Arduino I2C write buffer size
-  // max write = EEPROM pagesize - 64 bytes
+  if (eeaddress < shadow_len) {
+    for (byte i = 0; i < numbytes; i++) {
+      writeEEPROM(eeaddress + i, src[i]);
+    }
+
+    return;
+  }
+
+  ee_bytes_requested += numbytes;
+  writeDeviceBytes(eeaddress, src, numbytes);
+}
+
+//
+/// write a number of bytes directly to the device, bypassing the shadow
+//
+
+void MLCBConfig::writeDeviceBytes(unsigned int eeaddress, byte src[], byte numbytes) {
 
   int r = 0;
+  byte chunk;
 
   switch (eeprom_type) {
   case EEPROM_EXTERNAL:
-    I2Cbus->beginTransmission(external_address);
-    I2Cbus->write((int)(eeaddress >> 8));   // MSB
-    I2Cbus->write((int)(eeaddress & 0xFF)); // LSB
-
-    for (byte i = 0; i < numbytes; i++) {
-      I2Cbus->write(src[i]);
-    }
+    // split the write so that no chunk crosses an EEPROM page or exceeds the I2C buffer,
+    // and poll for completion of each write cycle rather than sleeping
+    ee_bytes_written += numbytes;
+
+    for (byte done = 0; done < numbytes; done += chunk) {
+      unsigned int addr = eeaddress + done;
+      unsigned int page_left = ext_page_size - (addr % ext_page_size);
+
+      chunk = numbytes - done;
+      chunk = (chunk > page_left) ? page_left : chunk;
+      chunk = (chunk > EE_EXT_MAX_WRITE) ? EE_EXT_MAX_WRITE : chunk;
+
+      waitForExtEEPROM();
+      ++ee_device_writes;
+      I2Cbus->beginTransmission(external_address);
+      I2Cbus->write((int)(addr >> 8));   // MSB
+      I2Cbus->write((int)(addr & 0xFF)); // LSB
+
+      for (byte i = 0; i < chunk; i++) {
+        I2Cbus->write(src[done + i]);
+      }
 
-    r = I2Cbus->endTransmission();
-    delay(5);
+      r = I2Cbus->endTransmission();
+      ext_write_pending = true;
 
-    if (r < 0) {
-      // DEBUG_SERIAL << F("> writeBytesEEPROM: I2C write error = ") << r << endl;
+      if (r != 0) {
+        // DEBUG_SERIAL << F("> writeBytesEEPROM: I2C write error = ") << r << endl;
+      }
     }
     break;
 
   case EEPROM_INTERNAL:
+    // each on-chip byte is a separate write cycle, so skip those that are unchanged
+    beginTransaction();
+
     for (byte i = 0; i < numbytes; i++) {
-      setChipEEPROMVal(eeaddress + i, src[i]);
+      if (getChipEEPROMVal(eeaddress + i) != src[i]) {
+        ++ee_device_writes;
+        ++ee_bytes_written;
+        setChipEEPROMVal(eeaddress + i, src[i]);
+      }
     }
+
+    commit();
     break;
 
   case EEPROM_USES_FLASH:
+    ++ee_device_writes;
+    ee_bytes_written += numbytes;
 // #ifdef __AVR_XMEGA__
 #if defined(DXCORE)
     flash_write_bytes(eeaddress, src, numbytes);
@@ -710,7 +1365,9 @@ void MLCBConfig::writeEvent(byte index, byte data[]) {
   int eeaddress = EE_EVENTS_START + (index * EE_BYTES_PER_EVENT);
 
   // DEBUG_SERIAL << F("> writeEvent, index = ") << index << F(", addr = ") << eeaddress << endl;
+  beginTransaction();
   writeBytesEEPROM(eeaddress, data, 4);
+  commit();
 
   return;
 }
@@ -739,15 +1396,19 @@ void MLCBConfig::resetEEPROM(void) {
 
     // DEBUG_SERIAL << F("> clearing data from external EEPROM ...") << endl;
 
-    for (unsigned int addr = 10; addr < 4096; addr++) {
-      writeEEPROM(addr, 0xff);
+    byte blank[EE_EXT_MAX_WRITE];
+    memset(blank, 0xff, sizeof(blank));
+
+    for (unsigned int addr = 10; addr < 4096; addr += EE_EXT_MAX_WRITE) {
+      writeBytesEEPROM(addr, blank, (4096 - addr < EE_EXT_MAX_WRITE) ? 4096 - addr : EE_EXT_MAX_WRITE);
     }
   } else if (eeprom_type == EEPROM_USES_FLASH) {
 // #ifdef __AVR_XMEGA__
 #if defined(DXCORE)
-    for (byte i = 0; i < 4; i++) {
-      memset(cache_page.data, 0xff, FLASH_PAGE_SIZE);
-      cache_page.dirty = true;
+    for (byte i = 0; i < NUM_FLASH_PAGES; i++) {
+      flash_page_t *cp = flash_cache_page(i);
+      memset(cp->data, 0xff, FLASH_PAGE_SIZE);
+      cp->dirty = true;
       flash_writeback_page(i);
     }
 #endif
@@ -850,6 +1511,11 @@ unsigned int MLCBConfig::freeSRAM(void) {
   char top;
   return &top - reinterpret_cast<char*>(sbrk(0));
 #endif
+
+#if !defined __AVR__ && !defined ESP32 && !defined ESP8266 && !defined __SAM3X8E__ && !defined ARDUINO_ARCH_RP2040
+  // free memory is not known on other platforms
+  return 0;
+#endif
 }
 
 void MLCBConfig::resetModule(void) {
@@ -857,6 +1523,16 @@ void MLCBConfig::resetModule(void) {
   /// implementation of resetModule() without MLCBswitch or MLCBLEDs
   // DEBUG_SERIAL << F("> resetting EEPROM") << endl;
 
+  // discard the shadow, as the device is about to be cleared underneath it and the module will reboot
+  free(shadow);
+  free(shadow_dirty);
+  shadow = NULL;
+  shadow_dirty = NULL;
+  shadow_len = 0;
+  shadow_num_dirty = 0;
+
+  beginTransaction();
+
   if (eeprom_type == EEPROM_INTERNAL) {
 
     // clear the entire on-chip EEPROM
@@ -874,6 +1550,11 @@ void MLCBConfig::resetModule(void) {
     resetEEPROM();
   }
 
+  // the log area may have been cleared along with everything else
+  if (nvlog_values != NULL) {
+    formatNVLog();
+  }
+
   // DEBUG_SERIAL << F("> setting SLiM config") << endl;
 
   // set the node identity defaults
@@ -890,12 +1571,205 @@ void MLCBConfig::resetModule(void) {
     writeNV(i + 1, 0);
   }
 
+  commit();
+  flush();
+
   // DEBUG_SERIAL << F("> complete in ") << (millis() - t) << F(", rebooting ... ") << endl;
 
   // reset complete
   reboot();
 }
 
+//
+/// use an append-only log for the node identity (addresses 0 - 9) and NVs
+/// this must be called after EE_NUM_NVS is set and before begin()
+/// the log area must not overlap the NVs or events, and is split into two banks: records are appended to the
+/// active bank and, when it is full, the latest values are compacted into the other bank, so that frequently
+/// changed values move across the storage rather than rewriting the same cells
+/// each record's check byte includes the bank's sequence number, so records left over from the bank's previous
+/// use fail the check and mark the end of the log -- no erase is needed before a bank is reused
+/// returns false if the area is too small to hold a compacted copy of every key
+//
+
+bool MLCBConfig::setNVLog(unsigned int start, unsigned int length) {
+
+  unsigned int bank_records = ((length / 2) - NVLOG_HEADER_LEN) / NVLOG_RECORD_LEN;
+
+  if (length / 2 <= NVLOG_HEADER_LEN || bank_records <= (unsigned int)NVLOG_IDENTITY_BYTES + EE_NUM_NVS) {
+    return false;
+  }
+
+  nvlog_start = start;
+  nvlog_len = length;
+  return true;
+}
+
+//
+/// the check byte of a log record
+//
+
+static inline byte nvlogCheck(byte key, byte value, byte seq) {
+  return key ^ value ^ seq ^ NVLOG_MAGIC;
+}
+
+//
+/// map an EEPROM address to a log key, or 0xff if the address is not kept in the log
+//
+
+byte MLCBConfig::NVLogKey(unsigned int eeaddress) {
+
+  if (eeaddress < NVLOG_IDENTITY_BYTES) {
+    return eeaddress;
+  }
+
+  if (eeaddress >= EE_NVS_START && eeaddress < EE_NVS_START + EE_NUM_NVS) {
+    return NVLOG_IDENTITY_BYTES + (eeaddress - EE_NVS_START);
+  }
+
+  return 0xff;
+}
+
+//
+/// find the active bank and rebuild the RAM index by replaying its records
+//
+
+void MLCBConfig::loadNVLog(void) {
+
+  unsigned int bank_len = nvlog_len / 2;
+  byte hdr[2][NVLOG_HEADER_LEN], rec[NVLOG_RECORD_LEN];
+  bool valid[2];
+
+  if (nvlog_values == NULL) {
+    nvlog_num_keys = NVLOG_IDENTITY_BYTES + EE_NUM_NVS;
+    nvlog_values = (byte *)malloc(nvlog_num_keys);
+    nvlog_present = (byte *)calloc((nvlog_num_keys + 7) / 8, 1);
+
+    if (nvlog_values == NULL || nvlog_present == NULL) {
+      free(nvlog_values);
+      free(nvlog_present);
+      nvlog_values = NULL;
+      nvlog_present = NULL;
+      nvlog_len = 0;
+      return;
+    }
+  }
+
+  for (byte b = 0; b < 2; b++) {
+    readBytesEEPROM(nvlog_start + (b * bank_len), NVLOG_HEADER_LEN, hdr[b]);
+    valid[b] = (hdr[b][0] == NVLOG_MAGIC);
+  }
+
+  if (!valid[0] && !valid[1]) {
+    // first use -- values remain at their fixed addresses until they are next written
+    formatNVLog();
+    return;
+  }
+
+  // the newer bank has the later sequence number, allowing for wrap around
+  if (valid[0] && valid[1]) {
+    nvlog_bank = ((byte)(hdr[1][1] - hdr[0][1]) < 128) ? 1 : 0;
+  } else {
+    nvlog_bank = valid[1] ? 1 : 0;
+  }
+
+  nvlog_seq = hdr[nvlog_bank][1];
+  memset(nvlog_present, 0, (nvlog_num_keys + 7) / 8);
+
+  for (nvlog_next = NVLOG_HEADER_LEN; nvlog_next + NVLOG_RECORD_LEN <= bank_len; nvlog_next += NVLOG_RECORD_LEN) {
+    readBytesEEPROM(nvlog_start + (nvlog_bank * bank_len) + nvlog_next, NVLOG_RECORD_LEN, rec);
+
+    // the first record that fails the check -- stale, erased or interrupted while being written -- marks the end of the log
+    if (rec[0] >= nvlog_num_keys || rec[2] != nvlogCheck(rec[0], rec[1], nvlog_seq)) {
+      break;
+    }
+
+    nvlog_values[rec[0]] = rec[1];
+    nvlog_present[rec[0] / 8] |= (1 << (rec[0] % 8));
+  }
+}
+
+//
+/// erase the log and start again with an empty bank 0
+/// this is the only time the log area is erased, as its previous contents are unknown
+/// the values of keys not in the log are read from their fixed addresses
+//
+
+void MLCBConfig::formatNVLog(void) {
+
+  byte blank[EE_SHADOW_BLOCK_SIZE];
+  byte hdr[NVLOG_HEADER_LEN] = { NVLOG_MAGIC, 0 };
+
+  memset(blank, 0xff, sizeof(blank));
+  beginTransaction();
+
+  for (unsigned int off = 0; off < nvlog_len; off += sizeof(blank)) {
+    writeBytesEEPROM(nvlog_start + off, blank, (nvlog_len - off < sizeof(blank)) ? nvlog_len - off : sizeof(blank));
+  }
+
+  writeBytesEEPROM(nvlog_start, hdr, NVLOG_HEADER_LEN);
+  commit();
+
+  nvlog_bank = 0;
+  nvlog_seq = 0;
+  nvlog_next = NVLOG_HEADER_LEN;
+  memset(nvlog_present, 0, (nvlog_num_keys + 7) / 8);
+}
+
+//
+/// copy the latest value of every key into the other bank, then make it the active bank
+/// the new bank's header is written last, so an interrupted compaction leaves the old bank in use
+//
+
+void MLCBConfig::compactNVLog(void) {
+
+  byte new_bank = nvlog_bank ^ 1;
+  unsigned int base = nvlog_start + (new_bank * (nvlog_len / 2));
+  unsigned int off = NVLOG_HEADER_LEN;
+  byte rec[NVLOG_RECORD_LEN], hdr[NVLOG_HEADER_LEN] = { NVLOG_MAGIC, (byte)(nvlog_seq + 1) };
+
+  beginTransaction();
+
+  for (byte key = 0; key < nvlog_num_keys; key++) {
+    if (nvlog_present[key / 8] & (1 << (key % 8))) {
+      rec[0] = key;
+      rec[1] = nvlog_values[key];
+      rec[2] = nvlogCheck(key, nvlog_values[key], hdr[1]);
+      writeBytesEEPROM(base + off, rec, NVLOG_RECORD_LEN);
+      off += NVLOG_RECORD_LEN;
+    }
+  }
+
+  writeBytesEEPROM(base, hdr, NVLOG_HEADER_LEN);
+  commit();
+
+  nvlog_bank = new_bank;
+  nvlog_seq = hdr[1];
+  nvlog_next = off;
+  ++nvlog_compactions;
+}
+
+//
+/// append a record to the active bank, compacting first if it is full
+//
+
+void MLCBConfig::appendNVLog(byte key, byte value) {
+
+  byte rec[NVLOG_RECORD_LEN] = { key, value, nvlogCheck(key, value, nvlog_seq) };
+
+  nvlog_values[key] = value;
+  nvlog_present[key / 8] |= (1 << (key % 8));
+
+  // compaction writes the updated value along with every other key
+  if (nvlog_next + NVLOG_RECORD_LEN > nvlog_len / 2) {
+    compactNVLog();
+    return;
+  }
+
+  writeBytesEEPROM(nvlog_start + (nvlog_bank * (nvlog_len / 2)) + nvlog_next, rec, NVLOG_RECORD_LEN);
+  nvlog_next += NVLOG_RECORD_LEN;
+  ++nvlog_appends;
+}
+
 //
 //
 /// load node identity from EEPROM
@@ -903,6 +1777,10 @@ void MLCBConfig::resetModule(void) {
 
 void MLCBConfig::loadNVs(void) {
 
+  if (nvlog_len > 0) {
+    loadNVLog();
+  }
+
   FLiM =     readEEPROM(0);
   CANID =    readEEPROM(1);
   nodeNum =  (readEEPROM(2) << 8) + readEEPROM(3);
@@ -911,21 +1789,12 @@ void MLCBConfig::loadNVs(void) {
 
 //
 /// check whether there is a collision for any hash in the event hash table
+/// the occupancy counts are maintained as entries change, so this is constant time
 //
 
 bool MLCBConfig::check_hash_collisions(void) {
 
-  for (byte i = 0; i < EE_MAX_EVENTS - 1; i++) {
-    for (byte j = i + 1; j < EE_MAX_EVENTS; j++) {
-      if (evhashtbl[i] == evhashtbl[j] && evhashtbl[i] != 0) {
-        // DEBUG_SERIAL << F("> hash collision detected, val = ") << evhashtbl[i] << endl;
-        // return when first collision detected
-        return true;
-      }
-    }
-  }
-
-  return false;
+  return (hash_collisions > 0);
 }
 
 //
@@ -941,11 +1810,41 @@ void MLCBConfig::setChipEEPROMVal(unsigned int eeaddress, byte val) {
   EEPROM.write(eeaddress, val);
 #endif
 
-#if defined ESP32 || defined ESP8266 || defined ARDUINO_ARCH_RP2040
-  EEPROM.commit();
+#ifdef MLCB_EEPROM_COMMIT
+  // inside a transaction, the commit is deferred until the outermost commit()
+  ee_commit_pending = true;
+
+  if (ee_transaction_depth == 0) {
+    commit();
+  }
 #endif
 }
 
+//
+/// group a number of writes so that emulated EEPROM is committed once, rather than after every byte
+/// transactions may be nested; only the outermost commit() writes to flash
+//
+
+void MLCBConfig::beginTransaction(void) {
+
+  ++ee_transaction_depth;
+}
+
+void MLCBConfig::commit(void) {
+
+  if (ee_transaction_depth > 0) {
+    --ee_transaction_depth;
+  }
+
+  if (ee_transaction_depth == 0 && ee_commit_pending) {
+#ifdef MLCB_EEPROM_COMMIT
+    EEPROM.commit();
+#endif
+    ee_commit_pending = false;
+    ++ee_commits;
+  }
+}
+
 ///
 
 byte MLCBConfig::getChipEEPROMVal(unsigned int eeaddress) {
@@ -980,38 +1879,94 @@ bool MLCBConfig::isResetFlagSet(void) {
 
 //
 /// flash routines for AVR-Dx devices
-/// we allocate 2048 bytes at the far end of flash, and cache the data of one of four 512 byte pages (0-3)
-/// dirty pages must be erased and written back before moving on
+/// we allocate 2048 bytes at the far end of flash, as four 512 byte pages (0-3), and cache up to FLASH_CACHE_PAGES of them
+/// writes go into the cache, and dirty pages are erased and written back when evicted, from MLCBConfig::process(), or by flush()
+/// pages are evicted least recently used first, so writes that alternate between pages do not thrash the cache
 //
 
 // #ifdef __AVR_XMEGA__
 #if defined(DXCORE)
-// cache a page of flash into memory
 
-void flash_cache_page(const byte page) {
+// find a page in the cache, or NULL if it is not cached
 
-  const uint32_t address_base = FLASH_AREA_BASE_ADDRESS + (page * FLASH_PAGE_SIZE);
+static flash_page_t *flash_find_page(const byte page) {
+
+  static bool initialised = false;
+
+  // mark every cache slot as unused on first use
+  if (!initialised) {
+    for (byte i = 0; i < FLASH_CACHE_PAGES; i++) {
+      cache_pages[i].page_num = 0xff;
+      cache_pages[i].dirty = false;
+      cache_pages[i].last_used = 0;
+    }
+
+    initialised = true;
+  }
+
+  for (byte i = 0; i < FLASH_CACHE_PAGES; i++) {
+    if (cache_pages[i].page_num == page) {
+      cache_pages[i].last_used = ++flash_cache_clock;
+      return &cache_pages[i];
+    }
+  }
+
+  return NULL;
+}
+
+// cache a page of flash into memory, evicting the least recently used page if necessary
+
+flash_page_t *flash_cache_page(const byte page) {
+
+  flash_page_t *cp = flash_find_page(page);
+
+  if (cp != NULL) {
+    return cp;
+  }
+
+  // choose an unused slot, else the least recently used
+  cp = &cache_pages[0];
+
+  for (byte i = 0; i < FLASH_CACHE_PAGES; i++) {
+    if (cache_pages[i].page_num == 0xff) {
+      cp = &cache_pages[i];
+      break;
+    }
+
+    if (cache_pages[i].last_used < cp->last_used) {
+      cp = &cache_pages[i];
+    }
+  }
+
+  if (cp->page_num != 0xff) {
+    flash_writeback_page(cp->page_num);
+  }
 
   // DEBUG_SERIAL << F("> flash_cache_page, page = ") << page << endl;
 
+  const uint32_t address_base = FLASH_AREA_BASE_ADDRESS + (page * FLASH_PAGE_SIZE);
+
   for (unsigned int a = 0; a < FLASH_PAGE_SIZE; a++) {
-    cache_page.data[a] = Flash.readByte(address_base + a);
+    cp->data[a] = Flash.readByte(address_base + a);
   }
 
-  cache_page.dirty = false;
-  return;
+  cp->page_num = page;
+  cp->dirty = false;
+  cp->last_used = ++flash_cache_clock;
+  return cp;
 }
 
-// write out a cached page to flash
+// write out a cached page to flash, if it is dirty
 
 bool flash_writeback_page(const byte page) {
 
   bool ret = true;
   uint32_t address;
+  flash_page_t *cp = flash_find_page(page);
 
-  // DEBUG_SERIAL << F("> flash_writeback_page, page = ") << curr_page_num << F(", dirty = ") << cache_page.dirty << endl;
+  // DEBUG_SERIAL << F("> flash_writeback_page, page = ") << page << endl;
 
-  if (cache_page.dirty) {
+  if (cp != NULL && cp->dirty) {
     address = FLASH_AREA_BASE_ADDRESS + (FLASH_PAGE_SIZE * page);
 
     // erase the existing page of flash memory
@@ -1021,91 +1976,97 @@ bool flash_writeback_page(const byte page) {
       // DEBUG_SERIAL.printf(F("error erasing flash page\r\n"));
     }
 
-    // write the nexw data
-    ret = Flash.writeBytes(address, cache_page.data, FLASH_PAGE_SIZE);
+    // write the new data
+    ret = Flash.writeBytes(address, cp->data, FLASH_PAGE_SIZE);
 
     if (ret != FLASHWRITE_OK) {
       // DEBUG_SERIAL.printf(F("error writing flash data\r\n"));
     }
 
-    cache_page.dirty = false;
+    cp->dirty = false;
   }
 
   return ret;
 }
 
-// write one or more bytes into the page cache, handling crossing a page boundary
-// address is the index into the flash area (0-2047), not the absolute memory address
+// write back one dirty page, returning false if there were none
 
-bool flash_write_bytes(const uint16_t address, const uint8_t *data, const uint16_t number) {
+bool flash_flush_page(void) {
 
-  bool ret = true;
+  for (byte i = 0; i < FLASH_CACHE_PAGES; i++) {
+    if (cache_pages[i].dirty) {
+      flash_writeback_page(cache_pages[i].page_num);
+      return true;
+    }
+  }
 
-  // DEBUG_SERIAL << F("> flash_write_bytes: address = ") << address << F(", data = ") << *data << F(", length = ") << length << endl;
+  return false;
+}
 
-  if (address >= (FLASH_PAGE_SIZE * NUM_FLASH_PAGES)) {
-    // DEBUG_SERIAL.printf(F("cache page address = %u is out of bounds\r\n"), address);
+// write back all dirty pages
+
+void flash_flush(void) {
+
+  while (flash_flush_page()) {
+    ;
   }
+}
+
+// write one or more bytes into the page cache, handling crossing a page boundary
+// address is the index into the flash area (0-2047), not the absolute memory address
+// the data reaches flash when the page is written back
 
-  // calculate page number, 0-3
-  byte new_page_num = address / FLASH_PAGE_SIZE;
+bool flash_write_bytes(const uint16_t address, const uint8_t *data, const uint16_t number) {
 
-  // DEBUG_SERIAL << F("> curr page = ") << curr_page_num << F(", new = ") << new_page_num << endl;
+  flash_page_t *cp = NULL;
 
-  // erase and write back current page if cache page number is changing
-  if (new_page_num != curr_page_num) {
-    flash_writeback_page(curr_page_num);                // write back current cache page
-    curr_page_num = new_page_num;                       // set new cache page num
-    flash_cache_page(curr_page_num);                    // cache the new page data from flash
-    cache_page.dirty = false;                           // set flag
-  }
+  // DEBUG_SERIAL << F("> flash_write_bytes: address = ") << address << F(", data = ") << *data << F(", length = ") << number << endl;
 
-  // calculate the address offset into the page cache buffer
-  uint16_t buffer_index = address % FLASH_PAGE_SIZE;
+  if (address + number > (FLASH_PAGE_SIZE * NUM_FLASH_PAGES)) {
+    // DEBUG_SERIAL.printf(F("cache page address = %u is out of bounds\r\n"), address);
+    return false;
+  }
 
-  // write data into cached page buffer
   for (uint16_t a = 0; a < number; a++) {
+    uint16_t buffer_index = (address + a) % FLASH_PAGE_SIZE;
 
-    // we are crossing a page boundary ...
-    if (buffer_index >= FLASH_PAGE_SIZE) {
-      // DEBUG_SERIAL.printf(F("crossing page boundary\r\n"));
-      cache_page.dirty = true;
-      flash_writeback_page(curr_page_num);              // write back current cache page
-      ++curr_page_num;                                  // increment the page number -- should really handle end of flash area
-      flash_cache_page(curr_page_num);                  // cache the new page data from flash
-      buffer_index = 0;                                 // set cache buffer index to zero
+    // first byte, or crossing a page boundary
+    if (cp == NULL || buffer_index == 0) {
+      cp = flash_cache_page((address + a) / FLASH_PAGE_SIZE);
     }
 
-    cache_page.data[buffer_index + a] = data[a];
+    if (cp->data[buffer_index] != data[a]) {
+      cp->data[buffer_index] = data[a];
+      cp->dirty = true;
+    }
   }
 
-  // set page dirty flag
-  cache_page.dirty = true;
+  flash_last_write = millis();
+  return true;
+}
 
-  // write the cache page to flash
-  flash_writeback_page(curr_page_num);
+// read one byte from the flash area
+// address is the index into the flash area; cached pages may hold data not yet written back, so are read first
+// uncached pages are read directly, so that reads do not evict dirty pages
 
-  return ret;
-}
+byte flash_read_byte(const uint16_t address) {
 
-// read one byte from flash
-// not via cache
+  flash_page_t *cp = flash_find_page(address / FLASH_PAGE_SIZE);
 
-byte flash_read_byte(uint32_t address) {
+  if (cp != NULL) {
+    return cp->data[address % FLASH_PAGE_SIZE];
+  }
 
-  return Flash.readByte(address);
+  return Flash.readByte(FLASH_AREA_BASE_ADDRESS + address);
 }
 
-// read multiple bytes from flash
+// read multiple bytes from the flash area
 // address is internal address map offset
-// not through cache
 
 void flash_read_bytes(const uint16_t address, const uint16_t number, uint8_t *dest) {
 
-  uint32_t base_address = FLASH_AREA_BASE_ADDRESS + address;
-
-  for (uint32_t a = 0; a < number; a++) {
-    dest[a] = flash_read_byte(base_address + a);
+  for (uint16_t a = 0; a < number; a++) {
+    dest[a] = flash_read_byte(address + a);
   }
 
   return;
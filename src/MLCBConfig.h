@@ -40,13 +40,44 @@
 #include <Wire.h>
 
 #include <MLCBLED.h>
-#include <MLCBswitch.h>
+#include <MLCBSwitch.h>
 
 // in-memory hash table
 static const byte EE_HASH_BYTES = 4;
 static const byte HASH_LENGTH = 128;
+static const byte EV_CHAIN_END = 0xff;                      // no further event table slot in a hash chain
 
 static const byte EEPROM_I2C_ADDR = 0x50;
+static const unsigned int EE_EXT_DEFAULT_PAGE_SIZE = 64;     // page size of the common 24LC256
+static const unsigned int EE_EXT_WRITE_TIMEOUT = 10;        // maximum write cycle time in millis, when polling for ACK
+
+// largest I2C write payload, after the two address bytes
+#ifdef BUFFER_LENGTH
+static const byte EE_EXT_MAX_WRITE = BUFFER_LENGTH - 2;
+#else
+static const byte EE_EXT_MAX_WRITE = 30;
+#endif
+
+// append-only log for the node identity and NVs
+static const byte NVLOG_MAGIC = 0xa5;                       // marks a bank header as valid
+static const byte NVLOG_HEADER_LEN = 2;                     // magic, sequence number
+static const byte NVLOG_RECORD_LEN = 3;                     // key, value, check
+static const byte NVLOG_IDENTITY_BYTES = 10;                // identity and flags at addresses 0 - 9
+
+// largest I2C read, which is also the burst size used to stream the event table at boot
+#ifdef BUFFER_LENGTH
+static const byte EE_EXT_MAX_READ = BUFFER_LENGTH;
+#else
+static const byte EE_EXT_MAX_READ = 32;
+#endif
+
+// optional direct-mapped index of short events
+static const byte SHORT_IDX_EMPTY = 0xff;                   // no short event maps to this slot
+static const byte SHORT_IDX_SHARED = 0xfe;                  // more than one short event maps to this slot
+
+// optional write-back RAM shadow of the EEPROM
+static const byte EE_SHADOW_BLOCK_SIZE = 16;                // dirty tracking granularity, divides the I2C EEPROM page size
+static const unsigned int EE_SHADOW_FLUSH_DELAY = 100;      // idle time in millis after the last write before dirty blocks are flushed
 
 enum {
   EEPROM_INTERNAL = 0,
@@ -54,6 +85,11 @@ enum {
   EEPROM_USES_FLASH
 };
 
+// platforms whose EEPROM is emulated in flash, and must be committed after writing
+#if defined ESP32 || defined ESP8266 || defined ARDUINO_ARCH_RP2040
+#define MLCB_EEPROM_COMMIT
+#endif
+
 // #ifdef __AVR_XMEGA__
 #if defined(DXCORE)
 #include <Flash.h>
@@ -62,16 +98,25 @@ enum {
 #define FLASH_PAGE_SIZE 512
 #define NUM_FLASH_PAGES 4
 
+#ifndef FLASH_CACHE_PAGES
+#define FLASH_CACHE_PAGES 2                                     // pages held in RAM, 1 - NUM_FLASH_PAGES, each costs FLASH_PAGE_SIZE bytes
+#endif
+
 typedef struct _flash_page {
   bool dirty;
+  byte page_num;                                                // 0xff if the cache slot is unused
+  unsigned long last_used;                                      // for least recently used replacement
   uint8_t data[FLASH_PAGE_SIZE];
 } flash_page_t;
 
-void flash_cache_page(const byte page);
+flash_page_t *flash_cache_page(const byte page);
 bool flash_writeback_page(const byte page);
+bool flash_flush_page(void);
+void flash_flush(void);
 bool flash_write_bytes(const uint16_t address, const uint8_t *data, const uint16_t number);
 byte flash_read_byte(const uint16_t address);
 void flash_read_bytes(const uint16_t address, const uint16_t number, uint8_t *dest);
+extern unsigned long flash_last_write;
 #endif
 
 //
@@ -87,22 +132,43 @@ public:
   byte findExistingEvent(unsigned int nn, unsigned int en);
   byte findEventSpace(void);
 
+  void setEventIndex(bool use_index);
+  void setEVCache(byte num_evs);
+  byte findEventKey(uint32_t key);
+  void indexEvent(byte idx, byte tarr[]);
+  void unindexEvent(byte idx);
+  bool setShortEventIndex(byte size);
+  void resetShortEventIndex(void);
+  void indexShortEvent(byte idx, byte tarr[]);
+  void unindexShortEvent(byte idx);
+
   void printEvHashTable(bool raw);
   byte getEvTableEntry(byte tindex);
   byte numEvents(void);
+  byte numFreeEvents(void);
   byte makeHash(byte tarr[]);
   void getEvArray(byte idx);
   void makeEvHashTable(void);
   void updateEvHashEntry(byte idx);
   void clearEvHashTable(void);
+  void setEvHashEntry(byte idx, byte hash);
+  void resetFreeMap(void);
   bool check_hash_collisions(void);
   byte getEventEVval(byte idx, byte evnum);
+  const byte *getEventEVs(byte idx, byte buf[]);
   void writeEventEV(byte idx, byte evnum, byte evval);
 
   byte readNV(byte idx);
   void writeNV(byte idx, byte val);
   void loadNVs(void);
 
+  bool setNVLog(unsigned int start, unsigned int length);
+  void loadNVLog(void);
+  void formatNVLog(void);
+  void compactNVLog(void);
+  byte NVLogKey(unsigned int eeaddress);
+  void appendNVLog(byte key, byte value);
+
   void readEvent(byte idx, byte tarr[]);
   void writeEvent(byte index, byte data[]);
   void cleareventEEPROM(byte index);
@@ -113,6 +179,13 @@ public:
   byte readBytesEEPROM(unsigned int eeaddress, byte nbytes, byte dest[]);
   void writeBytesEEPROM(unsigned int eeaddress, byte src[], byte numbytes);
   void resetEEPROM(void);
+  void writeDeviceBytes(unsigned int eeaddress, byte src[], byte numbytes);
+
+  void setShadow(bool use);
+  void loadShadow(void);
+  void flush(void);
+  bool flushBlock(void);
+  void process(void);
 
   void setCANID(byte canid);
   void setFLiM(bool f);
@@ -124,9 +197,13 @@ public:
 
   byte getChipEEPROMVal(unsigned int eeaddress);
   void setChipEEPROMVal(unsigned int eeaddress, byte val);
+  void beginTransaction(void);
+  void commit(void);
 
   bool setEEPROMtype(byte type);
   void setExtEEPROMAddress(byte address, TwoWire *bus = &Wire);
+  bool setExtEEPROMPageSize(unsigned int page_size);
+  bool waitForExtEEPROM(void);
   unsigned int freeSRAM(void);
   void reboot(void);
 
@@ -142,7 +219,40 @@ public:
   unsigned int nodeNum;
   byte eeprom_type;
   byte external_address;
+  unsigned int ext_page_size;
+  bool ext_write_pending;       // a write cycle may be in progress in the external EEPROM
   TwoWire *I2Cbus;
   byte *evhashtbl;
+  byte *evhashcounts;           // number of stored events with each hash value
+  byte *evhashhead;             // first event table slot with each hash value, or EV_CHAIN_END
+  byte *evhashnext;             // next event table slot with the same hash value, or EV_CHAIN_END
+  byte *evfreemap;              // one bit per event table slot, set if the slot is free
+  byte evused;                  // number of stored events
+  byte hash_collisions;         // number of hash values shared by more than one stored event
   bool hash_collision;
+  bool use_event_index;
+  uint32_t *evkeytbl;           // full NN + EN keys of stored events, sorted ascending
+  byte *evkeyidx;               // event table index of each key in evkeytbl
+  byte evkeycount;
+  byte short_idx_size;          // number of direct-mapped short event slots, a power of two; zero if not used
+  uint16_t *short_en;           // device number held in each short event slot
+  byte *short_slot;             // event table index held in each short event slot, or SHORT_IDX_EMPTY / SHORT_IDX_SHARED
+  byte evcache_width;           // number of EVs per event held in evcache, from EV1; zero if not used
+  byte *evcache;                // RAM copy of the first evcache_width EVs of every event slot
+  bool use_shadow;
+  byte *shadow;                 // RAM copy of EEPROM addresses 0 to shadow_len - 1
+  byte *shadow_dirty;           // one bit per EE_SHADOW_BLOCK_SIZE block that differs from the device
+  unsigned int shadow_len, shadow_num_dirty;
+  unsigned long shadow_last_write;
+  unsigned long ee_bytes_requested, ee_bytes_written, ee_device_writes;   // write amplification counters
+  byte ee_transaction_depth;    // nesting depth of beginTransaction() calls
+  bool ee_commit_pending;       // on-chip EEPROM has been written since the last commit
+  unsigned long ee_commits;
+  unsigned long boot_micros, evtable_load_micros;      // time taken by begin() and makeEvHashTable()
+  unsigned int nvlog_start, nvlog_len;                 // log area, split into two banks; zero length if not used
+  unsigned int nvlog_next;                             // offset of the next free record in the active bank
+  byte nvlog_bank, nvlog_seq, nvlog_num_keys;
+  byte *nvlog_values;                                  // RAM index: latest value of each key
+  byte *nvlog_present;                                 // one bit per key that has a record in the log
+  unsigned long nvlog_appends, nvlog_compactions;      // records appended to the log, and bank switches that compacted it
 };
@@ -0,0 +1,128 @@
+
+/*
+  Copyright (C) Duncan Greenwood 2023 (duncan_greenwood@hotmail.com)
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                  and indicate if changes were made. You may do so in any reasonable manner,
+                  but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                 your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                 legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+//
+/// single-producer, single-consumer lock-free ring buffer of CAN frames
+/// the head and tail indices are free-running bytes, masked when used to index the frame array,
+/// so the ring can hold its full depth and the number of frames held is simply head - tail
+//
+
+#include <MLCB.h>
+
+//
+/// allocate the frame storage -- depth must be a power of two from 2 to 128
+//
+
+bool CANFrameRing::allocate(byte depth) {
+
+  if (_frames != NULL || depth < 2 || depth > 128 || (depth & (depth - 1)) != 0) {
+    return false;
+  }
+
+  if ((_frames = (CANFrame *)malloc(depth * sizeof(CANFrame))) == NULL) {
+    return false;
+  }
+
+  _mask = depth - 1;
+  _head = 0;
+  _tail = 0;
+  return true;
+}
+
+//
+/// producer: copy a frame into the ring
+/// the frame is written before the head index is published
+//
+
+bool CANFrameRing::push(const CANFrame *frame) {
+
+  byte head = _head;
+  byte used = (byte)(head - _tail);
+
+  if (used > _mask) {
+    ++overflows;
+    return false;
+  }
+
+  _frames[head & _mask] = *frame;
+  MLCB_MEMORY_BARRIER();
+  _head = head + 1;
+
+  if (used + 1 > highwater) {
+    highwater = used + 1;
+  }
+
+  return true;
+}
+
+//
+/// consumer: the oldest frame in the ring, which remains valid until pop() is called
+/// returns NULL if the ring is empty
+//
+
+CANFrame *CANFrameRing::peek(void) {
+
+  byte tail = _tail;
+
+  if (_head == tail) {
+    return NULL;
+  }
+
+  MLCB_MEMORY_BARRIER();
+  return &_frames[tail & _mask];
+}
+
+//
+/// consumer: release the oldest frame
+/// the barrier ensures we have finished with the frame before the producer can reuse its slot
+//
+
+void CANFrameRing::pop(void) {
+
+  if (_head != _tail) {
+    MLCB_MEMORY_BARRIER();
+    _tail = _tail + 1;
+  }
+}
+
+//
+/// the number of frames held
+//
+
+byte CANFrameRing::count(void) {
+
+  return (byte)(_head - _tail);
+}
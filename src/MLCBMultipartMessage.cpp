@@ -44,9 +44,6 @@
 #include <MLCB.h>
 #include <Streaming.h>
 
-uint16_t crc16(uint8_t *data_p, uint16_t length);
-uint32_t crc32(const char *s, size_t n);
-
 //
 /// constructor
 /// receives a pointer to a MLCB object which provides the multipart message handling capability
@@ -140,7 +137,7 @@ bool MLCBMultipartMessage::process(void) {
 
 	/// send the next outgoing fragment, after a configurable delay to avoid flooding the bus
 
-	if (_send_buffer_index < _send_buffer_len && (millis() - _last_fragment_sent >= _msg_delay)) {
+	if (_send_buffer_index < _send_buffer_len && fragmentDue(_last_fragment_sent)) {
 
 		_last_fragment_sent = millis();
 
@@ -157,6 +154,7 @@ bool MLCBMultipartMessage::process(void) {
 		}
 
 		ret = sendMessageFragment(&frame, _send_priority);																			// send the data packet
+		fragmentSent(ret);
 		// DEBUG_SERIAL << F("> L: process: sent message fragment, seq = ") << _send_sequence_num << F(", size = ") << i << endl;
 
 		++_send_sequence_num;
@@ -302,7 +300,7 @@ bool MLCBMultipartMessage::sendMessageFragment(CANFrame * frame, const byte prio
 	frame->len = 8;
 	frame->data[0] = OPC_DTXC;
 
-	return (_MLCB_object_ptr->sendMessage(frame, false, false, priority));
+	return (_MLCB_object_ptr->queueMessage(frame, false, false, priority));
 }
 
 //
@@ -316,6 +314,111 @@ void MLCBMultipartMessage::setDelay(byte delay_in_millis) {
 	return;
 }
 
+//
+/// pace fragments with an adaptive token bucket instead of the fixed delay
+/// up to burst fragments may be sent back to back, refilled at a rate between min_rate and max_rate fragments per second
+/// the rate rises while the bus is quiet, and is halved when the bus is busy or the transmit queue backs up
+/// a burst of zero restores the fixed delay
+//
+
+void MLCBMultipartMessage::setPacing(byte burst, unsigned int max_rate, unsigned int min_rate) {
+
+	_pacing = (burst > 0 && max_rate > 0);
+	_pace_burst = burst;
+	_pace_max_rate = max_rate;
+	_pace_min_rate = (min_rate == 0 || min_rate > max_rate) ? max_rate : min_rate;
+	_pace_rate = (_pace_max_rate / 2 > _pace_min_rate) ? _pace_max_rate / 2 : _pace_min_rate;	// start midway, and adapt from there
+	_pace_credit = (unsigned long)burst * PACING_UNIT;
+	_pace_last_micros = micros();
+	_pace_window_start = millis();
+	_pace_window_frames = _MLCB_object_ptr->framesReceived();
+	_pace_backpressure = false;
+	return;
+}
+
+//
+/// decide whether the next fragment may be sent now
+//
+
+bool MLCBMultipartMessage::fragmentDue(unsigned long last_fragment_sent) {
+
+	if (!_pacing) {
+		return (millis() - last_fragment_sent >= _msg_delay);
+	}
+
+	updatePacing();
+
+	// hold fragments back while the transmit queue is full, rather than have them dropped
+	if (_MLCB_object_ptr->txQueueSize() > 0 && _MLCB_object_ptr->txQueueDepth() >= _MLCB_object_ptr->txQueueSize()) {
+		_pace_backpressure = true;
+		return false;
+	}
+
+	return (_pace_credit >= PACING_UNIT);
+}
+
+//
+/// refill the token bucket, and adjust the rate once per window
+//
+
+void MLCBMultipartMessage::updatePacing(void) {
+
+	unsigned long now = micros();
+	unsigned long elapsed = now - _pace_last_micros;
+	unsigned long cap = (unsigned long)_pace_burst * PACING_UNIT;
+
+	_pace_last_micros = now;
+
+	// limit the elapsed time to that needed to fill the bucket, so the credit cannot overflow
+	if (elapsed > cap / _pace_rate) {
+		elapsed = cap / _pace_rate;
+	}
+
+	_pace_credit += elapsed * _pace_rate;
+
+	if (_pace_credit > cap) {
+		_pace_credit = cap;
+	}
+
+	unsigned long window = millis() - _pace_window_start;
+
+	if (window >= MULTIPART_PACING_WINDOW) {
+		unsigned long frames = _MLCB_object_ptr->framesReceived() - _pace_window_frames;
+		byte depth = _MLCB_object_ptr->txQueueDepth(), size = _MLCB_object_ptr->txQueueSize();
+
+		if (_pace_backpressure || frames * 1000UL > (unsigned long)MULTIPART_PACING_BUSY_RATE * window || (size > 0 && depth * 2 > size)) {
+			// multiplicative decrease
+			_pace_rate = (_pace_rate / 2 > _pace_min_rate) ? _pace_rate / 2 : _pace_min_rate;
+		} else {
+			// additive increase
+			unsigned int step = (_pace_max_rate / 16 > 0) ? _pace_max_rate / 16 : 1;
+			_pace_rate = (_pace_rate + step < _pace_max_rate) ? _pace_rate + step : _pace_max_rate;
+		}
+
+		_pace_window_start = millis();
+		_pace_window_frames = _MLCB_object_ptr->framesReceived();
+		_pace_backpressure = false;
+	}
+}
+
+//
+/// take a token for a fragment that has been queued, or note the failure to queue it
+/// a fragment that was not queued costs no token, as it will be sent again
+//
+
+void MLCBMultipartMessage::fragmentSent(bool queued) {
+
+	if (!_pacing) {
+		return;
+	}
+
+	if (!queued) {
+		_pace_backpressure = true;
+	} else if (_pace_credit >= PACING_UNIT) {
+		_pace_credit -= PACING_UNIT;
+	}
+}
+
 //
 /// set the receive timeout
 /// if an expected next fragment is not received, the user's handler function
@@ -337,49 +440,161 @@ void MLCBMultipartMessage::setTimeout(unsigned int timeout_in_millis) {
 
 //
 /// allocate memory for receive and send contexts
+/// all contexts, receive buffers and hot field arrays come from a single allocation, so the heap is not fragmented
+/// any existing contexts are released first, and there may be at most 254 receive contexts
 //
 
 bool MLCBMultipartMessageEx::allocateContexts(byte num_receive_contexts, unsigned int receive_buffer_len, byte num_send_contexts) {
 
-	byte i;
+	byte *storage;
+
+	releaseContexts();
+
+	// 0xff marks the end of a demultiplexer chain, so it cannot also be a context index
+	if (num_receive_contexts > 254) {
+		return false;
+	}
+
+	if ((storage = (byte *)malloc(contextStorageSize(num_receive_contexts, receive_buffer_len, num_send_contexts))) == NULL) {
+		return false;
+	}
+
+	layoutContexts(storage, num_receive_contexts, receive_buffer_len, num_send_contexts);
+	_storage_owned = true;
+
+	// DEBUG_SERIAL << F("> Lex: allocated send and receive contexts ok") << endl;
+	return true;
+}
+
+//
+/// use caller-provided storage for the receive and send contexts, e.g. a static array, so that no heap is used
+/// storage_len must be at least contextStorageSize() for the same arguments, and there may be at most 254 receive contexts
+//
+
+bool MLCBMultipartMessageEx::useContextStorage(void *storage, size_t storage_len, byte num_receive_contexts, unsigned int receive_buffer_len, byte num_send_contexts) {
+
+	releaseContexts();
+
+	if (storage == NULL || num_receive_contexts > 254 || storage_len < contextStorageSize(num_receive_contexts, receive_buffer_len, num_send_contexts)) {
+		return false;
+	}
+
+	layoutContexts((byte *)storage, num_receive_contexts, receive_buffer_len, num_send_contexts);
+	return true;
+}
+
+//
+/// carve the context pool out of a single block of storage
+/// the context structs come first, aligned, followed by the receive buffers, the byte-wide hot field arrays and the receive demultiplexer
+//
 
-	// DEBUG_SERIAL << F("> receive_context_t * = ") << sizeof(receive_context_t *) << F(", receive_context_t = ") << sizeof(receive_context_t) << endl;
+void MLCBMultipartMessageEx::layoutContexts(byte *storage, byte num_receive_contexts, unsigned int receive_buffer_len, byte num_send_contexts) {
 
+	byte *p;
+	uintptr_t aligned;
+
+	_context_storage = storage;
 	_num_receive_contexts = num_receive_contexts;
 	_receive_buffer_len = receive_buffer_len;
 	_num_send_contexts = num_send_contexts;
 
-	// allocate receive contexts
-	if ((_receive_context = (receive_context_t **)malloc(sizeof(receive_context_t *) * _num_receive_contexts)) == NULL) {
-		return false;
+	aligned = ((uintptr_t)storage + contextAlignment() - 1) & ~(uintptr_t)(contextAlignment() - 1);
+	_receive_context = (receive_context_t *)aligned;
+
+	aligned = ((uintptr_t)&_receive_context[num_receive_contexts] + contextAlignment() - 1) & ~(uintptr_t)(contextAlignment() - 1);
+	_send_context = (send_context_t *)aligned;
+
+	p = (byte *)&_send_context[num_send_contexts];
+
+	for (byte i = 0; i < num_receive_contexts; i++) {
+		_receive_context[i].buffer = p;
+		p += receive_buffer_len;
 	}
 
-	for (i = 0; i < _num_receive_contexts; i++) {
-		if ((_receive_context[i] = (receive_context_t *)malloc(sizeof(receive_context_t))) == NULL) {
-			return false;
-		}
+	_rx_in_use = (bool *)p;
+	p += num_receive_contexts;
+	_rx_stream_id = p;
+	p += num_receive_contexts;
+	_rx_canid = p;
+	p += num_receive_contexts;
+	_tx_in_use = (bool *)p;
+	p += num_send_contexts;
+	_tx_stream_id = p;
+	p += num_send_contexts;
+	_tx_active = p;
+	_num_active_sends = 0;
+	p += num_send_contexts;
+	_rx_next = p;
+	p += num_receive_contexts;
+	_rx_free = p;
+	p += num_receive_contexts;
+	_rx_bucket = p;
+	_rx_hash_mask = demuxTableSize(num_receive_contexts) - 1;
+
+	memset(_rx_bucket, 0xff, demuxTableSize(num_receive_contexts));
+
+	// all receive contexts start free, and are claimed lowest first
+	for (byte i = 0; i < num_receive_contexts; i++) {
+		_rx_free[i] = num_receive_contexts - 1 - i;
+	}
 
-		if ((_receive_context[i]->buffer = (byte *)malloc(receive_buffer_len * sizeof(byte))) == NULL) {
-			return false;
+	_rx_free_count = num_receive_contexts;
+
+	memset(_rx_in_use, 0, num_receive_contexts * sizeof(bool));
+	memset(_tx_in_use, 0, num_send_contexts * sizeof(bool));
+}
+
+//
+/// release the context pool and any reserved send buffers
+/// messages still being sent are abandoned, and heap copies of them freed
+//
+
+void MLCBMultipartMessageEx::releaseContexts(void) {
+
+	for (byte i = 0; i < _num_send_contexts; i++) {
+		if (_tx_in_use[i] && _send_context[i].send_mode == MULTIPART_SEND_HEAP) {
+			free((void *)_send_context[i].buffer);
 		}
+	}
 
-		_receive_context[i]->in_use = false;
+	if (_storage_owned) {
+		free(_context_storage);
 	}
 
-	// allocate send contexts - user code provides the buffer when sending
-	if ((_send_context = (send_context_t **)malloc(sizeof(send_context_t *) * _num_send_contexts)) == NULL) {
+	free(_send_pool);
+
+	_storage_owned = false;
+	_context_storage = NULL;
+	_receive_context = NULL;
+	_send_context = NULL;
+	_rx_in_use = _tx_in_use = NULL;
+	_rx_stream_id = _rx_canid = _tx_stream_id = _tx_active = NULL;
+	_rx_bucket = _rx_next = _rx_free = NULL;
+	_rx_hash_mask = 0;
+	_rx_free_count = 0;
+	_num_active_sends = 0;
+	_send_pool = NULL;
+	_send_pool_len = 0;
+	_num_receive_contexts = 0;
+	_num_send_contexts = 0;
+}
+
+//
+/// reserve a copy buffer for each send context, called after allocateContexts()
+/// sendMultipartMessage() then copies messages up to this length into the context's slot instead of the heap
+//
+
+bool MLCBMultipartMessageEx::reserveSendBuffers(unsigned int send_buffer_len) {
+
+	if (_send_context == NULL || _send_pool != NULL || send_buffer_len == 0) {
 		return false;
 	}
 
-	for (i = 0; i < _num_send_contexts; i++) {
-		if ((_send_context[i] = (send_context_t *)malloc(sizeof(send_context_t))) == NULL) {
-			return false;
-		}
-
-		_send_context[i]->in_use = false;
+	if ((_send_pool = (byte *)malloc(_num_send_contexts * send_buffer_len)) == NULL) {
+		return false;
 	}
 
-	// DEBUG_SERIAL << F("> Lex: allocated send and receive contexts ok") << endl;
+	_send_pool_len = send_buffer_len;
 	return true;
 }
 
@@ -387,10 +602,42 @@ bool MLCBMultipartMessageEx::allocateContexts(byte num_receive_contexts, unsigne
 /// initiate sending of a multipart message
 /// this method sends the first message - the header packet
 /// the remainder of the message is sent in fragments from the process() method
+/// the message is copied, so the caller's buffer may be reused at once
 //
 
 bool MLCBMultipartMessageEx::sendMultipartMessage(const void *msg, const unsigned int msg_len, const byte stream_id, const byte priority) {
 
+	return startSend(msg, msg_len, stream_id, priority, true);
+}
+
+//
+/// initiate sending of a multipart message directly from the caller's buffer, without copying it
+/// the buffer must not be changed or released until the send complete handler is called for this stream
+//
+
+bool MLCBMultipartMessageEx::sendMultipartMessageNoCopy(const void *msg, const unsigned int msg_len, const byte stream_id, const byte priority) {
+
+	return startSend(msg, msg_len, stream_id, priority, false);
+}
+
+//
+/// set the function called once every fragment of an outgoing message has been queued
+/// msg is the caller's buffer for messages sent with sendMultipartMessageNoCopy(), and NULL for copied messages
+//
+
+void MLCBMultipartMessageEx::setSendCompleteHandler(void (*sendcompletehandler)(const void *msg, unsigned int msg_len, byte stream_id)) {
+
+	_sendcompletehandler = sendcompletehandler;
+	return;
+}
+
+//
+/// common send setup: claim a context, take or copy the payload and send the header packet
+/// copies are binary-safe, and go into the context's pool slot when one is reserved and large enough
+//
+
+bool MLCBMultipartMessageEx::startSend(const void *msg, const unsigned int msg_len, const byte stream_id, const byte priority, const bool copy) {
+
 	byte i;
 	uint16_t msg_crc = 0;
 	CANFrame frame;
@@ -398,8 +645,8 @@ bool MLCBMultipartMessageEx::sendMultipartMessage(const void *msg, const unsigne
 	// DEBUG_SERIAL << F("> Lex: sending message header packet, stream id = ") << stream_id << F(", message length = ") << msg_len << endl;
 
 	// ensure we aren't already sending a message with this stream ID
-	for (i = 0; i < _num_send_contexts; i++) {
-		if (_send_context[i]->in_use && _send_context[i]->send_stream_id == stream_id) {
+	for (i = 0; i < _num_active_sends; i++) {
+		if (_tx_stream_id[_tx_active[i]] == stream_id) {
 			// DEBUG_SERIAL << F("> Lex: ERROR: already sending this stream ID") << endl;
 			return false;
 		}
@@ -407,46 +654,79 @@ bool MLCBMultipartMessageEx::sendMultipartMessage(const void *msg, const unsigne
 
 	// find a free send context
 	for (i = 0; i < _num_send_contexts; i++) {
-		if (!_send_context[i]->in_use) {
+		if (!_tx_in_use[i]) {
 			break;
 		}
 	}
 
-	if (i > _num_send_contexts) {
+	if (i >= _num_send_contexts) {
 		// DEBUG_SERIAL << F("> Lex: ERROR: unable to find free send context") << endl;
 		return false;
 	}
 
 	// DEBUG_SERIAL << F("> Lex: using send context = ") << i << endl;
 
-	// initialise context
-	_send_context[i]->in_use = true;
-	// _send_context[i]->buffer = (byte *)msg;
-	_send_context[i]->buffer = (byte *)strdup((char *)msg);														// copy the message to the send content, will free later
-	_send_context[i]->send_buffer_len = msg_len;
-	_send_context[i]->send_stream_id = stream_id;
-	_send_context[i]->send_priority = priority;
-	_send_context[i]->send_buffer_index = 0;
+	// take the caller's buffer, or copy the message to the context's pool slot or the heap
+	if (!copy || msg_len == 0) {
+		_send_context[i].buffer = (const byte *)msg;
+		_send_context[i].send_mode = MULTIPART_SEND_CALLER;
+	} else if (_send_pool != NULL && msg_len <= _send_pool_len) {
+		byte *slot = &_send_pool[i * _send_pool_len];
+
+		memcpy(slot, msg, msg_len);
+		_send_context[i].buffer = slot;
+		_send_context[i].send_mode = MULTIPART_SEND_POOL;
+	} else {
+		byte *buffer = (byte *)malloc(msg_len);
+
+		if (buffer == NULL) {
+			// DEBUG_SERIAL << F("> Lex: ERROR: unable to copy message") << endl;
+			return false;
+		}
+
+		memcpy(buffer, msg, msg_len);
+		_send_context[i].buffer = buffer;
+		_send_context[i].send_mode = MULTIPART_SEND_HEAP;
+	}
 
 	// calc CRC
 	if (_use_crc) {
-		msg_crc = crc16((uint8_t *)msg, msg_len);
+		msg_crc = crc16((const byte *)msg, msg_len);
 	}
 
 	// send the first fragment which forms the header message
-	frame.data[1] = _send_context[i]->send_stream_id;																	// the stream id
+	frame.data[1] = stream_id;																							// the stream id
 	frame.data[2] = 0;																																// sequence number, 0 = header packet
-	frame.data[3] = highByte(_send_context[i]->send_buffer_len);										  // the message length
-	frame.data[4] = lowByte(_send_context[i]->send_buffer_len);
+	frame.data[3] = highByte(msg_len);																				  // the message length
+	frame.data[4] = lowByte(msg_len);
 	frame.data[5] = highByte(msg_crc);																							  // CRC, zero if not implemented
 	frame.data[6] = lowByte(msg_crc);
 	frame.data[7] = 0;																																// flags - 0 = standard data message
 
-	bool ret = sendMessageFragment(&frame, _send_context[i]->send_priority);					// send the header packet
-	_send_context[i]->send_sequence_num = 1;																	  			// the next send sequence number - it's fine if it wraps around
+	// the context is only committed once the header is queued, so a failed send leaves nothing behind
+	if (!sendMessageFragment(&frame, priority)) {
+		if (_send_context[i].send_mode == MULTIPART_SEND_HEAP) {
+			free((void *)_send_context[i].buffer);
+		}
 
-	// DEBUG_SERIAL << F("> Lex: message header sent, stream id = ") << stream_id << F(", message length = ") << msg_len << F(", ret = ") << ret << endl;
-	return (ret);
+		_send_context[i].buffer = NULL;
+		// DEBUG_SERIAL << F("> Lex: ERROR: unable to send message header") << endl;
+		return false;
+	}
+
+	// initialise context
+	_tx_in_use[i] = true;
+	_send_context[i].send_buffer_len = msg_len;
+	_tx_stream_id[i] = stream_id;
+	_send_context[i].send_priority = priority;
+	_send_context[i].send_buffer_index = 0;
+	_send_context[i].send_sequence_num = 1;																	  			// the next send sequence number - it's fine if it wraps around
+	_send_context[i].sched_credit = 0;
+	_send_context[i].last_fragment_sent = millis();
+	_tx_active[_num_active_sends++] = i;
+
+	// DEBUG_SERIAL << F("> Lex: message header sent, stream id = ") << stream_id << F(", message length = ") << msg_len << endl;
+	return true;
 }
 
 //
@@ -458,65 +738,240 @@ bool MLCBMultipartMessageEx::process(void) {
 
 	bool ret = true;
 	byte i;
-	CANFrame frame;
-
-	static byte context = 0;				// we round-robin the context list when sending
 
 	/// check receive timeout for each active context
 
 	for (i = 0; i < _num_receive_contexts; i++) {
-		if (_receive_context[i]->in_use && (millis() - _receive_context[i]->last_fragment_received >= _receive_timeout)) {
+		if (_rx_in_use[i] && (millis() - _receive_context[i].last_fragment_received >= _receive_timeout)) {
 
 			// DEBUG_SERIAL << F("> Lex: ERROR: timed out waiting for continuation packet in context = ") << i << F(", timeout = ") << _receive_timeout << endl;
-			(void)(*_messagehandler)(_receive_context[i]->buffer, _receive_context[i]->receive_buffer_index, _receive_context[i]->receive_stream_id, MLCB_MULTIPART_MESSAGE_TIMEOUT_ERROR);
-			_receive_context[i]->in_use = false;
-			// _receive_context[i]->incoming_message_length = 0;
-			// _receive_context[i]->incoming_bytes_received = 0;
+			(void)(*_messagehandler)(_receive_context[i].buffer, _receive_context[i].receive_buffer_index, _rx_stream_id[i], MLCB_MULTIPART_MESSAGE_TIMEOUT_ERROR);
+			releaseReceiveContext(i);
+			// _receive_context[i].incoming_message_length = 0;
+			// _receive_context[i].incoming_bytes_received = 0;
 		}
 	}
 
-	/// send the next outgoing fragment from each active context, after a configurable delay to avoid flooding the bus
-	/// concurrent streams will be interleaved
+	/// send up to the budgeted number of fragments, each from the active context chosen by the scheduler
+	/// concurrent streams will be interleaved, in proportion to their priority
 
-	if (_send_context[context]->in_use && millis() - _send_context[context]->last_fragment_sent >= _msg_delay)  {
+	for (i = 0; i < _send_budget; i++) {
+		// with pacing, a single token bucket governs all contexts
+		if (_pacing && !fragmentDue(0)) {
+			break;
+		}
 
-		// DEBUG_SERIAL << F("> Lex: processing send context = ") << context << endl;
+		byte context = nextSendContext();
 
-		memset(&frame.data, 0, sizeof(frame.data));
-		frame.data[1] = _send_context[context]->send_stream_id;
-		frame.data[2] = _send_context[context]->send_sequence_num;
+		if (context >= _num_send_contexts) {
+			break;
+		}
 
-		/// only the last fragment is potentially less than 5 bytes long
+		// stop at the first fragment that could not be queued, it will be retried on the next call
+		if (!sendNextFragment(context)) {
+			ret = false;
+			break;
+		}
+	}
 
-		for (i = 0; i < 5 && _send_context[context]->send_buffer_index < _send_context[context]->send_buffer_len; i++) {								// for up to 5 bytes of payload
-			frame.data[i + 3] = _send_context[context]->buffer[_send_context[context]->send_buffer_index];																// take the next byte
-			// DEBUG_SERIAL << F("> Lex: consumed data byte = ") << (char)_send_context[context]->buffer[_send_context[context]->send_buffer_index] << endl;
-			++_send_context[context]->send_buffer_index;
+	return ret;
+}
+
+//
+/// set the maximum number of fragments sent by each call to process(), default one
+//
+
+void MLCBMultipartMessageEx::setSendBudget(byte max_fragments) {
+
+	_send_budget = (max_fragments > 0) ? max_fragments : 1;
+	return;
+}
+
+//
+/// choose the active send context to send the next fragment, using smooth weighted round-robin
+/// each context that is due gains credit equal to its weight, the one with most credit is chosen and pays back the total
+/// the weight comes from the CAN priority, so a more urgent stream (lower value) gets a larger share without starving the others
+/// returns _num_send_contexts if no context is due
+//
+
+byte MLCBMultipartMessageEx::nextSendContext(void) {
+
+	byte i, k, best = _num_send_contexts;
+	int total = 0;
+	bool timed = (!_pacing && _msg_delay > 0);
+	unsigned long now = timed ? millis() : 0;
+
+	for (k = 0; k < _num_active_sends; k++) {
+		i = _tx_active[k];
+
+		// without pacing, each context keeps its own fixed delay between fragments
+		if (timed && now - _send_context[i].last_fragment_sent < _msg_delay) {
+			continue;
 		}
 
-		ret = sendMessageFragment(&frame, _send_context[context]->send_priority);																												// send the data packet
-		// DEBUG_SERIAL << F("> Lex: process: sent message fragment, seq = ") << _send_context[context]->send_sequence_num << F(", size = ") << i << F(", ret  = ") << ret << endl;
+		int weight = 16 - (_send_context[i].send_priority & 0x0f);
+		_send_context[i].sched_credit += weight;
+		total += weight;
 
-		// release context once message content exhausted
-		if (_send_context[context]->send_buffer_index >= _send_context[context]->send_buffer_len) {
-			_send_context[context]->in_use = false;
-			_send_context[context]->send_buffer_len = 0;
-			free(_send_context[context]->buffer);
-			// DEBUG_SERIAL << F("> Lex: message complete, context released") << endl;
-		} else {
-			++_send_context[context]->send_sequence_num;
-			_send_context[context]->last_fragment_sent = millis();
+		if (best >= _num_send_contexts || _send_context[i].sched_credit > _send_context[best].sched_credit) {
+			best = i;
 		}
 	}
 
-	// increment context counter and wrap
-	++context;
-	context = (context >= _num_send_contexts) ? 0 : context;
+	if (best < _num_send_contexts) {
+		_send_context[best].sched_credit -= total;
+	}
+
+	return best;
+}
+
+//
+/// send the next fragment of a context's message, and release the context when the message is complete
+//
+
+bool MLCBMultipartMessageEx::sendNextFragment(byte context) {
+
+	byte i;
+	CANFrame frame;
+	unsigned int start_index = _send_context[context].send_buffer_index;
+
+	// DEBUG_SERIAL << F("> Lex: processing send context = ") << context << endl;
+
+	memset(&frame.data, 0, sizeof(frame.data));
+	frame.data[1] = _tx_stream_id[context];
+	frame.data[2] = _send_context[context].send_sequence_num;
+
+	/// only the last fragment is potentially less than 5 bytes long
+
+	for (i = 0; i < 5 && _send_context[context].send_buffer_index < _send_context[context].send_buffer_len; i++) {								// for up to 5 bytes of payload
+		frame.data[i + 3] = _send_context[context].buffer[_send_context[context].send_buffer_index];																// take the next byte
+		// DEBUG_SERIAL << F("> Lex: consumed data byte = ") << (char)_send_context[context].buffer[_send_context[context].send_buffer_index] << endl;
+		++_send_context[context].send_buffer_index;
+	}
+
+	bool ret = sendMessageFragment(&frame, _send_context[context].send_priority);																		// send the data packet
+	fragmentSent(ret);
+	// DEBUG_SERIAL << F("> Lex: process: sent message fragment, seq = ") << _send_context[context].send_sequence_num << F(", size = ") << i << F(", ret  = ") << ret << endl;
+
+	// a fragment that was not queued is rewound, so the same bytes are resent with the same sequence number
+	if (!ret) {
+		_send_context[context].send_buffer_index = start_index;
+		return false;
+	}
+
+	// release context once message content exhausted
+	if (_send_context[context].send_buffer_index >= _send_context[context].send_buffer_len) {
+		releaseSendContext(context);
+		// DEBUG_SERIAL << F("> Lex: message complete, context released") << endl;
+	} else {
+		++_send_context[context].send_sequence_num;
+		_send_context[context].last_fragment_sent = millis();
+	}
+
 	return ret;
 }
 
+//
+/// release a send context whose message has been sent, and tell the user
+//
+
+void MLCBMultipartMessageEx::releaseSendContext(byte i) {
+
+	const void *msg = (_send_context[i].send_mode == MULTIPART_SEND_CALLER) ? _send_context[i].buffer : NULL;
+	unsigned int msg_len = _send_context[i].send_buffer_len;
+
+	if (_send_context[i].send_mode == MULTIPART_SEND_HEAP) {
+		free((void *)_send_context[i].buffer);
+	}
+
+	// remove the context from the active list, keeping the others in order
+	for (byte k = 0; k < _num_active_sends; k++) {
+		if (_tx_active[k] == i) {
+			memmove(&_tx_active[k], &_tx_active[k + 1], _num_active_sends - k - 1);
+			--_num_active_sends;
+			break;
+		}
+	}
+
+	_tx_in_use[i] = false;
+	_send_context[i].send_buffer_len = 0;
+	_send_context[i].buffer = NULL;
+
+	// the context is free before the handler is called, so it may send again on the same stream
+	if (_sendcompletehandler != NULL) {
+		(void)(*_sendcompletehandler)(msg, msg_len, _tx_stream_id[i]);
+	}
+}
+
+//
+/// find the receive context for a stream from a sender, in the demultiplexer
+/// returns _num_receive_contexts if there is none
+//
+
+byte MLCBMultipartMessageEx::findReceiveContext(byte canid, byte stream_id) {
+
+	// without contexts there is no demultiplexer to search
+	if (_num_receive_contexts == 0) {
+		return _num_receive_contexts;
+	}
+
+	for (byte i = _rx_bucket[demuxHash(canid, stream_id)]; i != 0xff; i = _rx_next[i]) {
+		if (_rx_stream_id[i] == stream_id && _rx_canid[i] == canid) {
+			return i;
+		}
+	}
+
+	return _num_receive_contexts;
+}
+
+//
+/// claim a receive context for a new stream from a sender, and add it to the demultiplexer
+/// a context already receiving the same stream from the same sender is reused
+/// returns _num_receive_contexts if none is free
+//
+
+byte MLCBMultipartMessageEx::claimReceiveContext(byte canid, byte stream_id) {
+
+	byte i = findReceiveContext(canid, stream_id);
+
+	if (i < _num_receive_contexts || _rx_free_count == 0) {
+		return i;
+	}
+
+	byte h = demuxHash(canid, stream_id);
+
+	i = _rx_free[--_rx_free_count];
+	_rx_in_use[i] = true;
+	_rx_stream_id[i] = stream_id;
+	_rx_canid[i] = canid;
+	_rx_next[i] = _rx_bucket[h];
+	_rx_bucket[h] = i;
+	return i;
+}
+
+//
+/// release a receive context, removing it from the demultiplexer
+//
+
+void MLCBMultipartMessageEx::releaseReceiveContext(byte i) {
+
+	byte *link = &_rx_bucket[demuxHash(_rx_canid[i], _rx_stream_id[i])];
+
+	while (*link != 0xff && *link != i) {
+		link = &_rx_next[*link];
+	}
+
+	if (*link == i) {
+		*link = _rx_next[i];
+	}
+
+	_rx_in_use[i] = false;
+	_rx_free[_rx_free_count++] = i;
+}
+
 //
 /// subscribe to a range of stream IDs
+/// the stream IDs are read once, so later changes to the array need another call
 //
 
 void MLCBMultipartMessageEx::subscribe(byte *stream_ids, const byte num_stream_ids, void (*messagehandler)(void *msg, unsigned int msg_len, byte stream_id, byte status)) {
@@ -525,6 +980,13 @@ void MLCBMultipartMessageEx::subscribe(byte *stream_ids, const byte num_stream_i
 	_num_stream_ids = num_stream_ids;
 	_messagehandler = messagehandler;
 
+	// header packets are checked against a bitmap of the stream IDs, built here
+	memset(_subscribed, 0, sizeof(_subscribed));
+
+	for (byte i = 0; i < num_stream_ids; i++) {
+		bitSet(_subscribed[stream_ids[i] / 8], stream_ids[i] % 8);
+	}
+
 	// DEBUG_SERIAL << F("> Lex: subscribe: num_stream_ids = ") << num_stream_ids << endl;
 	return;
 }
@@ -536,15 +998,7 @@ void MLCBMultipartMessageEx::subscribe(byte *stream_ids, const byte num_stream_i
 
 byte MLCBMultipartMessageEx::is_sending(void) {
 
-	byte i, num_streams;
-
-	for (i = 0, num_streams = 0; i < _num_send_contexts; i++) {
-		if (_send_context[i]->in_use) {
-			++num_streams;
-		}
-	}
-
-	return num_streams;
+	return _num_active_sends;
 }
 
 //
@@ -564,36 +1018,25 @@ void MLCBMultipartMessageEx::processReceivedMessageFragment(const CANFrame *fram
 
 			// DEBUG_SERIAL << F("> Lex: this is a data message header packet") << endl;
 
-			for (i = 0; i < _num_stream_ids; i++) {
-				if (_stream_ids[i] == frame->data[1]) {																				// are we subscribed to this stream id ?
+			if (bitRead(_subscribed[frame->data[1] / 8], frame->data[1] % 8)) {															// are we subscribed to this stream id ?
 
-					// DEBUG_SERIAL << F("> Lex: we are subscribed to this stream ID = ") << frame->data[1] << endl;
+				// DEBUG_SERIAL << F("> Lex: we are subscribed to this stream ID = ") << frame->data[1] << endl;
 
-					// find a free receive context
-					for (i = 0; i < _num_receive_contexts; i++) {
-						if (!_receive_context[i]->in_use) {
-							// DEBUG_SERIAL << F("> Lex: using receive context = ") << i << endl;
-							break;
-						}
-					}
+				// claim a receive context, or restart the one already receiving this stream from this sender
+				i = claimReceiveContext(frame->id & 0x7f, frame->data[1]);
 
-					if (i < _num_receive_contexts) {
-						_receive_context[i]->in_use = true;
-						_receive_context[i]->receive_stream_id = frame->data[1];
-						_receive_context[i]->incoming_message_length = (frame->data[3] << 8) + frame->data[4];
-						_receive_context[i]->incoming_message_crc = (frame->data[5] << 8) + frame->data[6];
-						_receive_context[i]->incoming_bytes_received = 0;
-						memset(_receive_context[i]->buffer, 0, _receive_buffer_len);
-						_receive_context[i]->receive_buffer_index = 0;
-						_receive_context[i]->expected_next_receive_sequence_num = 1;
-						_receive_context[i]->sender_canid = (frame->id & 0x7f);
-						_receive_context[i]->last_fragment_received = millis();
-						// DEBUG_SERIAL << F("> Lex: received header packet for stream id = ") << _receive_context[i]->receive_stream_id << F(", message length = ") << _receive_context[i]->incoming_message_length << endl;
-					} else {
-						// DEBUG_SERIAL << F("> Lex: unable to find free receive context for new message") << endl;
-					}
-
-					break;
+				if (i < _num_receive_contexts) {
+					_receive_context[i].incoming_message_length = (frame->data[3] << 8) + frame->data[4];
+					_receive_context[i].incoming_message_crc = (frame->data[5] << 8) + frame->data[6];
+					_receive_context[i].incoming_bytes_received = 0;
+					memset(_receive_context[i].buffer, 0, _receive_buffer_len);
+					_receive_context[i].receive_buffer_index = 0;
+					_receive_context[i].expected_next_receive_sequence_num = 1;
+					_receive_context[i].last_fragment_received = millis();
+					_receive_context[i].crc.reset();
+					// DEBUG_SERIAL << F("> Lex: received header packet for stream id = ") << _rx_stream_id[i] << F(", message length = ") << _receive_context[i].incoming_message_length << endl;
+				} else {
+					// DEBUG_SERIAL << F("> Lex: unable to find free receive context for new message") << endl;
 				}
 			}
 		} else {
@@ -604,12 +1047,7 @@ void MLCBMultipartMessageEx::processReceivedMessageFragment(const CANFrame *fram
 		// DEBUG_SERIAL << F("> Lex: this is a continuation packet") << endl;
 
 		// find a matching receive context, using the stream ID and sender CANID
-		for (i = 0; i < _num_receive_contexts; i++) {
-			if (_receive_context[i]->in_use && _receive_context[i]->receive_stream_id == frame->data[1] && _receive_context[i]->sender_canid == (frame->id & 0x7f)) {
-				// DEBUG_SERIAL << F("> Lex: found matching receive context = ") << i << endl;
-				break;
-			}
-		}
+		i = findReceiveContext(frame->id & 0x7f, frame->data[1]);
 
 		// return if not found
 		if (i >= _num_receive_contexts) {
@@ -618,52 +1056,60 @@ void MLCBMultipartMessageEx::processReceivedMessageFragment(const CANFrame *fram
 		}
 
 		// error if out of sequence
-		if (frame->data[2] != _receive_context[i]->expected_next_receive_sequence_num) {
-			// DEBUG_SERIAL << F("> Lex: ERROR: expected receive sequence num = ") << _receive_context[i]->expected_next_receive_sequence_num << F(" but got = ") << frame->data[2] << endl;
-			(void)(*_messagehandler)(_receive_context[i]->buffer, _receive_context[i]->receive_buffer_index, _receive_context[i]->receive_stream_id, MLCB_MULTIPART_MESSAGE_SEQUENCE_ERROR);
-			_receive_context[i]->in_use = false;
+		if (frame->data[2] != _receive_context[i].expected_next_receive_sequence_num) {
+			// DEBUG_SERIAL << F("> Lex: ERROR: expected receive sequence num = ") << _receive_context[i].expected_next_receive_sequence_num << F(" but got = ") << frame->data[2] << endl;
+			(void)(*_messagehandler)(_receive_context[i].buffer, _receive_context[i].receive_buffer_index, _rx_stream_id[i], MLCB_MULTIPART_MESSAGE_SEQUENCE_ERROR);
+			releaseReceiveContext(i);
 			return;
 		}
 
+		_receive_context[i].last_fragment_received = millis();
+
 		// consume up to 5 bytes of message data from this fragment
+		// the CRC is folded in fragment by fragment, so completing a message costs no more than any other fragment
 		for (j = 0; j < 5; j++) {
 			// DEBUG_SERIAL << F("> Lex: consuming received data byte = ") << (char)frame->data[j + 3] << endl;
-			_receive_context[i]->buffer[_receive_context[i]->receive_buffer_index] = frame->data[j + 3];
-			++_receive_context[i]->receive_buffer_index;
-			++_receive_context[i]->incoming_bytes_received;
-			_receive_context[i]->last_fragment_received = millis();
+			_receive_context[i].buffer[_receive_context[i].receive_buffer_index] = frame->data[j + 3];
+			++_receive_context[i].receive_buffer_index;
+			++_receive_context[i].incoming_bytes_received;
 
 			// if we have consumed the entire message, surface it to the user's handler
-			if (_receive_context[i]->incoming_bytes_received >= _receive_context[i]->incoming_message_length) {
+			if (_receive_context[i].incoming_bytes_received >= _receive_context[i].incoming_message_length) {
 				// DEBUG_SERIAL << F("> Lex: message data has been fully consumed") << endl;
 
-				if (_use_crc && _receive_context[i]->incoming_message_crc != 0) {
+				if (_use_crc && _receive_context[i].incoming_message_crc != 0) {
 					// DEBUG_SERIAL << F("> Lex: calculating CRC16") << endl;
-					tmpcrc = crc16((uint8_t *)_receive_context[i]->buffer, _receive_context[i]->receive_buffer_index);
+					_receive_context[i].crc.update(&frame->data[3], j + 1);
+					tmpcrc = _receive_context[i].crc.value();
 				}
 
-				if (_receive_context[i]->incoming_message_crc != tmpcrc) {
-					// DEBUG_SERIAL << F("> Lex: message CRC error, expected = ") << _receive_context[i]->incoming_message_crc << F(", calculated = ") << tmpcrc << endl;
+				if (_receive_context[i].incoming_message_crc != tmpcrc) {
+					// DEBUG_SERIAL << F("> Lex: message CRC error, expected = ") << _receive_context[i].incoming_message_crc << F(", calculated = ") << tmpcrc << endl;
 					status = MLCB_MULTIPART_MESSAGE_CRC_ERROR;
 				} else {
 					status = MLCB_MULTIPART_MESSAGE_COMPLETE;
 				}
 
-				(void)(*_messagehandler)(_receive_context[i]->buffer, _receive_context[i]->receive_buffer_index, _receive_context[i]->receive_stream_id, status);
-				_receive_context[i]->in_use = false;
+				(void)(*_messagehandler)(_receive_context[i].buffer, _receive_context[i].receive_buffer_index, _rx_stream_id[i], status);
+				releaseReceiveContext(i);
 				break;
 
 				// if the buffer is now full, give the user what we have with an error status
-			} else if (_receive_context[i]->receive_buffer_index >= _receive_buffer_len ) {
+			} else if (_receive_context[i].receive_buffer_index >= _receive_buffer_len ) {
 				// DEBUG_SERIAL << F("> Lex: buffer is now full, message truncated") << endl;
-				(void)(*_messagehandler)(_receive_context[i]->buffer, _receive_context[i]->receive_buffer_index, _receive_context[i]->receive_stream_id, MLCB_MULTIPART_MESSAGE_TRUNCATED);
-				_receive_context[i]->in_use = false;
+				(void)(*_messagehandler)(_receive_context[i].buffer, _receive_context[i].receive_buffer_index, _rx_stream_id[i], MLCB_MULTIPART_MESSAGE_TRUNCATED);
+				releaseReceiveContext(i);
 				break;
 			}
 		}
 
+		// a context still in use has consumed all 5 bytes
+		if (_use_crc && _rx_in_use[i] && _receive_context[i].incoming_message_crc != 0) {
+			_receive_context[i].crc.update(&frame->data[3], 5);
+		}
+
 		// increment the expected next sequence number for this stream context
-		++_receive_context[i]->expected_next_receive_sequence_num;
+		++_receive_context[i].expected_next_receive_sequence_num;
 	}
 
 	return;
@@ -678,64 +1124,3 @@ void MLCBMultipartMessageEx::use_crc(bool use_crc) {
 	_use_crc = use_crc;
 	return;
 }
-
-///////////////////////////////////////////////////////////////////////////////
-//////// CRC implementations
-
-uint32_t crc32(const byte *s, size_t n) {
-
-	uint32_t crc = 0xFFFFFFFF;
-
-	for (size_t i = 0; i < n; i++) {
-		uint8_t ch = s[i];
-		for (size_t j = 0; j < 8; j++) {
-			uint32_t b = (ch ^ crc) & 1;
-			crc >>= 1;
-			if (b) crc = crc ^ 0xEDB88320;
-			ch >>= 1;
-		}
-	}
-
-	return ~crc;
-}
-
-/*
-//                                      16   12   5
-// this is the CCITT CRC 16 polynomial X  + X  + X  + 1.
-// This works out to be 0x1021, but the way the algorithm works
-// lets us use 0x8408 (the reverse of the bit pattern).  The high
-// bit is always assumed to be set, thus we only use 16 bits to
-// represent the 17 bit value.
-*/
-
-// http://stjarnhimlen.se/snippets/crc-16.c
-
-#define POLY 0x8408
-
-uint16_t crc16(uint8_t *data_p, uint16_t length) {
-
-	uint8_t i;
-	uint16_t data;
-	uint16_t crc = 0xffff;
-
-	if (length == 0) {
-		return (~crc);
-	}
-
-	do {
-		for (i = 0, data = (uint16_t)0xff & *data_p++;
-		     i < 8;
-		     i++, data >>= 1) {
-			if ((crc & 0x0001) ^ (data & 0x0001))
-				crc = (crc >> 1) ^ POLY;
-			else  crc >>= 1;
-		}
-	} while (--length);
-
-	crc = ~crc;
-	data = crc;
-	crc = (crc << 8) | (data >> 8 & 0xff);
-
-	return (crc);
-}
-
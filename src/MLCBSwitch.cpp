@@ -36,7 +36,7 @@
 */
 
 // #include <Streaming.h>
-#include "MLCBswitch.h"
+#include "MLCBSwitch.h"
 
 //
 /// a class to encapsulate a physical pushbutton switch, with non-blocking processing